@@ -0,0 +1,225 @@
+-- Measures read, readTensor, write and writeTensor throughput over a set
+-- of synthetic schemas. Results are printed as tab separated lines with a
+-- header, so they can be saved and handed back as a baseline:
+--    th bench/bench.lua -output base.tsv
+--    th bench/bench.lua -baseline base.tsv
+-- Allocations are the bytes of Lua heap allocated per record, measured
+-- with the collector stopped. Tensor storages live outside the Lua heap
+-- and are not counted.
+require 'torch'
+local thrift = require 'libthrift'
+
+local cmd = torch.CmdLine()
+cmd:text('Benchmarks the thrift codec')
+cmd:option('-time', 0.5, 'seconds to spend on every case')
+cmd:option('-filter', '', 'only run cases whose name contains this')
+cmd:option('-output', '', 'also write the results to this file')
+cmd:option('-baseline', '', 'compare against results saved with -output')
+cmd:option('-threshold', 5, 'percent slowdown against the baseline that counts as a regression')
+local opt = cmd:parse(arg or { })
+
+local function range(n, f)
+   local t = { }
+   for i = 1,n do
+      t[i] = f(i)
+   end
+   return t
+end
+
+local cases = {
+   {
+      name = "flat",
+      desc = {
+         ttype = "struct",
+         fields = {
+            [1] = { ttype = "i32", name = "id" },
+            [2] = { ttype = "i64", name = "timestamp" },
+            [3] = { ttype = "double", name = "score" },
+            [4] = { ttype = "bool", name = "active" },
+            [5] = { ttype = "i16", name = "kind" },
+            [6] = { ttype = "byte", name = "flags" },
+            [7] = { ttype = "string", name = "country" },
+            [8] = { ttype = "double", name = "weight" },
+         },
+      },
+      value = {
+         id = 123456, timestamp = 1400000000000, score = 0.75, active = true,
+         kind = 12, flags = 3, country = "US", weight = 1.5,
+      },
+   },
+   {
+      name = "wide",
+      desc = {
+         ttype = "struct",
+         fields = {
+            [1] = { ttype = "set", value = "i64", name = "binary" },
+            [2] = { ttype = "map", key = "i64", value = "double", name = "continuous" },
+            [3] = { ttype = "map", key = "i64", value = "i64", name = "discrete" },
+            [4] = { ttype = "map", key = "i64", value = "string", name = "text" },
+         },
+      },
+      value = {
+         binary = range(50, function(i) return i * 7919 end),
+         continuous = range(200, function(i) return i / 3 end),
+         discrete = range(100, function(i) return i * 31 end),
+         text = range(20, function(i) return "value " .. i end),
+      },
+   },
+   {
+      name = "nested",
+      desc = {
+         ttype = "struct",
+         fields = {
+            [1] = {
+               ttype = "list",
+               name = "items",
+               value = {
+                  ttype = "struct",
+                  fields = {
+                     [1] = { ttype = "i32", name = "id" },
+                     [2] = { ttype = "double", name = "score" },
+                     [3] = { ttype = "list", value = "i32", name = "tags" },
+                  },
+               },
+            },
+         },
+      },
+      value = {
+         items = range(100, function(i) return { id = i, score = i / 7, tags = { i, i + 1, i + 2 } } end),
+      },
+   },
+   {
+      name = "tensors",
+      desc = {
+         ttype = "struct",
+         tensors = true,
+         fields = {
+            [1] = { ttype = "list", value = "double", name = "dense" },
+            [2] = { ttype = "list", value = "i32", name = "ids" },
+            [3] = { ttype = "list", value = "byte", name = "pixels" },
+         },
+      },
+      value = {
+         dense = torch.DoubleTensor(10000):uniform(),
+         ids = torch.IntTensor(10000):random(0, 1000000),
+         pixels = torch.ByteTensor(65536):random(0, 255),
+      },
+   },
+   {
+      name = "strings",
+      desc = {
+         ttype = "struct",
+         fields = {
+            [1] = { ttype = "string", name = "body" },
+            [2] = { ttype = "list", value = "string", name = "tokens" },
+         },
+      },
+      value = {
+         body = string.rep("lorem ipsum ", 400),
+         tokens = range(100, function(i) return string.rep(string.char(97 + i % 26), 64) end),
+      },
+   },
+}
+
+-- Calls f until at least the given number of seconds went by and returns
+-- the number of calls and the time they took.
+local function measure(f, seconds)
+   f()
+   local n, elapsed = 1, 0
+   while true do
+      local timer = torch.Timer()
+      for _ = 1,n do
+         f()
+      end
+      elapsed = timer:time().real
+      if elapsed >= seconds then
+         return n, elapsed
+      end
+      n = n * 2
+   end
+end
+
+local function allocated(f)
+   local n = 16
+   collectgarbage()
+   collectgarbage('stop')
+   local before = collectgarbage('count')
+   for _ = 1,n do
+      f()
+   end
+   local kb = (collectgarbage('count') - before) / n
+   collectgarbage('restart')
+   collectgarbage()
+   return kb * 1024
+end
+
+local header = { "case", "method", "bytes", "mb_per_s", "records_per_s", "alloc_bytes" }
+local results = { }
+
+local function report(row)
+   results[#results + 1] = row
+   print(table.concat(row, '\t'))
+end
+
+print(table.concat(header, '\t'))
+for _,case in ipairs(cases) do
+   if case.name:find(opt.filter, 1, true) then
+      local codec = thrift.codec(case.desc)
+      local binary = codec:write(case.value)
+      local bytes = codec:writeTensor(case.value)
+      local methods = {
+         { "read", function() return codec:read(binary) end },
+         { "readTensor", function() return codec:readTensor(bytes) end },
+         { "write", function() return codec:write(case.value) end },
+         { "writeTensor", function() return codec:writeTensor(case.value) end },
+      }
+      for _,method in ipairs(methods) do
+         local n, elapsed = measure(method[2], opt.time)
+         report({
+            case.name,
+            method[1],
+            #binary,
+            string.format('%.2f', #binary * n / elapsed / (1024 * 1024)),
+            string.format('%.0f', n / elapsed),
+            string.format('%.0f', allocated(method[2])),
+         })
+      end
+   end
+end
+
+if opt.output ~= '' then
+   local f = assert(io.open(opt.output, 'w'))
+   f:write(table.concat(header, '\t'), '\n')
+   for _,row in ipairs(results) do
+      f:write(table.concat(row, '\t'), '\n')
+   end
+   f:close()
+end
+
+if opt.baseline ~= '' then
+   local base = { }
+   for line in io.lines(opt.baseline) do
+      local case, method, _, mbps = line:match('^([^\t]+)\t([^\t]+)\t([^\t]+)\t([^\t]+)')
+      if case and tonumber(mbps) then
+         base[case .. '.' .. method] = tonumber(mbps)
+      end
+   end
+   print()
+   print(table.concat({ "case", "method", "baseline_mb_per_s", "mb_per_s", "change_percent" }, '\t'))
+   local regressions = 0
+   for _,row in ipairs(results) do
+      local before = base[row[1] .. '.' .. row[2]]
+      if before then
+         local change = (tonumber(row[4]) - before) / before * 100
+         local mark = ''
+         if change < -opt.threshold then
+            regressions = regressions + 1
+            mark = '\tREGRESSION'
+         end
+         print(string.format('%s\t%s\t%.2f\t%s\t%+.1f%s', row[1], row[2], before, row[4], change, mark))
+      end
+   end
+   if regressions > 0 then
+      os.exit(1)
+   end
+end
@@ -0,0 +1,32 @@
+-- Measures decoding of large numeric lists into tensors.
+-- Run twice to compare the vectorized and scalar byte swap kernels:
+--    th bench/tensors.lua
+--    THRIFT_NO_SIMD=1 th bench/tensors.lua
+require 'torch'
+local thrift = require 'libthrift'
+
+local size = tonumber(arg and arg[1]) or 1000000
+local iterations = tonumber(arg and arg[2]) or 20
+
+local types = {
+   { ttype = "byte", tensor = "ByteTensor" },
+   { ttype = "i16", tensor = "ShortTensor" },
+   { ttype = "i32", tensor = "IntTensor" },
+   { ttype = "i64", tensor = "LongTensor" },
+   { ttype = "double", tensor = "DoubleTensor" },
+}
+
+for _,t in ipairs(types) do
+   local codec = thrift.codec({ ttype = "list", value = t.ttype, tensors = true })
+   local values = torch[t.tensor](size):random(0, 100)
+   local binary = codec:write(values)
+   codec:read(binary)
+   local timer = torch.Timer()
+   for _ = 1,iterations do
+      codec:read(binary)
+   end
+   local elapsed = timer:time().real
+   local mb = (string.len(binary) * iterations) / (1024 * 1024)
+   print(string.format('list<%s> x %d: %8.2f MB/s, %8.2f M elements/s', t.ttype, size,
+      mb / elapsed, (size * iterations) / elapsed / 1e6))
+end
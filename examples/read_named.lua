@@ -7,12 +7,11 @@ local codec = thrift.codec({
       [3] = { ttype = "list", value = "double", name = "vector" },
    }
 })
-local f = io.open('thrift_data.bin', 'r')
-if not f then
+local ok, file = pcall(function() return codec:openFile('thrift_data.bin') end)
+if not ok then
    error('Please run "th write.lua" first to generate binary data.')
 end
-local binary = f:read('*all')
-f:close()
-print('Read '..string.len(binary)..' bytes from "thrift_data.bin".')
-local result = codec:read(binary)
-print(result)
+for result in file do
+   print(result)
+end
+file:close()
@@ -0,0 +1,190 @@
+//
+//  block.h
+//
+//  Block record files hold framed records in blocks that are compressed
+//  independently, followed by an index of the blocks and a footer that
+//  points at the index. All integers are big-endian.
+//
+//     header   magic u32, version u8, compression u8, reserved u16
+//     block    compressed size u32, raw size u32, records u32, bytes
+//     index    per block its offset u64 and its records u32
+//     footer   index offset u64, blocks u32, magic u32
+//
+//  Like protocol.h this never touches a lua_State and reports failures as
+//  a negative errno. zlib is always available, LZ4 and zstd only when the
+//  build found them.
+//
+#pragma once
+
+#include "endianutils.h"
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef THRIFT_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef THRIFT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define BLOCK_MAGIC          (0x54424c4b)
+#define BLOCK_VERSION        (1)
+#define BLOCK_HEADER_SIZE    (8)
+#define BLOCK_FRAME_SIZE     (12)
+#define BLOCK_INDEX_SIZE     (12)
+#define BLOCK_FOOTER_SIZE    (16)
+
+#define BLOCK_NONE           (0)
+#define BLOCK_ZLIB           (1)
+#define BLOCK_LZ4            (2)
+#define BLOCK_ZSTD           (3)
+
+static uint32_t block_get_u32(const uint8_t *p) {
+   uint32_t u32;
+   memcpy(&u32, p, sizeof(u32));
+   return betoh32(u32);
+}
+
+static uint64_t block_get_u64(const uint8_t *p) {
+   uint64_t u64;
+   memcpy(&u64, p, sizeof(u64));
+   return betoh64(u64);
+}
+
+static void block_put_u32(uint8_t *p, uint32_t u32) {
+   u32 = htobe32(u32);
+   memcpy(p, &u32, sizeof(u32));
+}
+
+static void block_put_u64(uint8_t *p, uint64_t u64) {
+   u64 = htobe64(u64);
+   memcpy(p, &u64, sizeof(u64));
+}
+
+// Returns the compression of the given name, -EINVAL for unknown names and
+// -ENOTSUP for compressions this build does not include.
+static int block_compression(const char *name) {
+   if (strcmp(name, "none") == 0) return BLOCK_NONE;
+   if (strcmp(name, "zlib") == 0) return BLOCK_ZLIB;
+#ifdef THRIFT_HAVE_LZ4
+   if (strcmp(name, "lz4") == 0) return BLOCK_LZ4;
+#else
+   if (strcmp(name, "lz4") == 0) return -ENOTSUP;
+#endif
+#ifdef THRIFT_HAVE_ZSTD
+   if (strcmp(name, "zstd") == 0) return BLOCK_ZSTD;
+#else
+   if (strcmp(name, "zstd") == 0) return -ENOTSUP;
+#endif
+   return -EINVAL;
+}
+
+static int block_supported(int compression) {
+   switch (compression) {
+      case BLOCK_NONE:
+      case BLOCK_ZLIB:
+         return 1;
+#ifdef THRIFT_HAVE_LZ4
+      case BLOCK_LZ4:
+         return 1;
+#endif
+#ifdef THRIFT_HAVE_ZSTD
+      case BLOCK_ZSTD:
+         return 1;
+#endif
+      default:
+         return 0;
+   }
+}
+
+// Largest compressed size of n bytes.
+static size_t block_bound(int compression, size_t n) {
+   switch (compression) {
+      case BLOCK_ZLIB: return compressBound(n);
+#ifdef THRIFT_HAVE_LZ4
+      case BLOCK_LZ4: return LZ4_compressBound(n);
+#endif
+#ifdef THRIFT_HAVE_ZSTD
+      case BLOCK_ZSTD: return ZSTD_compressBound(n);
+#endif
+      default: return n;
+   }
+}
+
+// Largest raw size n compressed bytes can decompress to, which keeps a
+// corrupt frame from making readers allocate more than its data can hold.
+// deflate tops out at 1032:1, an LZ4 sequence byte at 255 bytes of output
+// and a zstd RLE block at 128 KiB for 4 bytes.
+static uint64_t block_max_raw(int compression, size_t n) {
+   switch (compression) {
+      case BLOCK_NONE: return n;
+      case BLOCK_ZLIB: return (uint64_t)n * 1032;
+      case BLOCK_LZ4: return (uint64_t)n * 256;
+      case BLOCK_ZSTD: return (uint64_t)n * 32768;
+      default: return 0;
+   }
+}
+
+// Compresses n bytes into dst, which holds block_bound bytes, and sets
+// *size to the compressed size. A level of 0 picks the default one.
+static int block_compress(int compression, int level, const uint8_t *src, size_t n, uint8_t *dst, size_t *size) {
+   switch (compression) {
+      case BLOCK_NONE:
+         memcpy(dst, src, n);
+         *size = n;
+         return 0;
+      case BLOCK_ZLIB: {
+         uLongf len = compressBound(n);
+         if (compress2(dst, &len, src, n, level ? level : Z_DEFAULT_COMPRESSION) != Z_OK) return -EINVAL;
+         *size = len;
+         return 0;
+      }
+#ifdef THRIFT_HAVE_LZ4
+      case BLOCK_LZ4: {
+         int len = LZ4_compress_default((const char *)src, (char *)dst, n, LZ4_compressBound(n));
+         if (len <= 0) return -EINVAL;
+         *size = len;
+         return 0;
+      }
+#endif
+#ifdef THRIFT_HAVE_ZSTD
+      case BLOCK_ZSTD: {
+         size_t len = ZSTD_compress(dst, ZSTD_compressBound(n), src, n, level);
+         if (ZSTD_isError(len)) return -EINVAL;
+         *size = len;
+         return 0;
+      }
+#endif
+      default:
+         return -ENOTSUP;
+   }
+}
+
+// Decompresses n bytes into the size bytes at dst, failing unless they
+// decompress to exactly that many.
+static int block_decompress(int compression, const uint8_t *src, size_t n, uint8_t *dst, size_t size) {
+   switch (compression) {
+      case BLOCK_NONE:
+         if (n != size) return -EINVAL;
+         memcpy(dst, src, n);
+         return 0;
+      case BLOCK_ZLIB: {
+         uLongf len = size;
+         if (uncompress(dst, &len, src, n) != Z_OK || len != size) return -EINVAL;
+         return 0;
+      }
+#ifdef THRIFT_HAVE_LZ4
+      case BLOCK_LZ4:
+         if (LZ4_decompress_safe((const char *)src, (char *)dst, n, size) != (int)size) return -EINVAL;
+         return 0;
+#endif
+#ifdef THRIFT_HAVE_ZSTD
+      case BLOCK_ZSTD:
+         if (ZSTD_decompress(dst, size, src, n) != size) return -EINVAL;
+         return 0;
+#endif
+      default:
+         return -ENOTSUP;
+   }
+}
@@ -0,0 +1,240 @@
+//
+//  bswaputils.h
+//
+//  Bulk big-endian <-> host conversion of arrays of 16, 32 and 64 bit
+//  values. Used to move whole numeric lists between Thrift binary and
+//  Torch storages in one call. SSSE3 and AVX2 kernels are picked at
+//  runtime on x86, everything else goes through the scalar loop.
+//  Setting THRIFT_NO_SIMD in the environment forces the scalar loop.
+//
+#pragma once
+
+#include "endianutils.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+   defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define THRIFT_BSWAP_X86 (1)
+#include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define THRIFT_BSWAP_NOOP (1)
+#endif
+
+static void thrift_bswap16_scalar(void *dst, const void *src, size_t n) {
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   for (size_t i = 0; i < n; i++) {
+      uint16_t v;
+      memcpy(&v, s + i * sizeof(v), sizeof(v));
+      v = betoh16(v);
+      memcpy(d + i * sizeof(v), &v, sizeof(v));
+   }
+}
+
+static void thrift_bswap32_scalar(void *dst, const void *src, size_t n) {
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   for (size_t i = 0; i < n; i++) {
+      uint32_t v;
+      memcpy(&v, s + i * sizeof(v), sizeof(v));
+      v = betoh32(v);
+      memcpy(d + i * sizeof(v), &v, sizeof(v));
+   }
+}
+
+static void thrift_bswap64_scalar(void *dst, const void *src, size_t n) {
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   for (size_t i = 0; i < n; i++) {
+      uint64_t v;
+      memcpy(&v, s + i * sizeof(v), sizeof(v));
+      v = betoh64(v);
+      memcpy(d + i * sizeof(v), &v, sizeof(v));
+   }
+}
+
+#ifdef THRIFT_BSWAP_X86
+
+#define BSWAP_SIMD_NONE   (0)
+#define BSWAP_SIMD_SSSE3  (1)
+#define BSWAP_SIMD_AVX2   (2)
+
+// Column readers call this from several threads, the level is detected
+// by whichever gets there first and every thread finds the same one.
+static int thrift_bswap_simd_level(void) {
+   static int level = -1;
+   int l = __atomic_load_n(&level, __ATOMIC_RELAXED);
+   if (l < 0) {
+      l = BSWAP_SIMD_NONE;
+      if (getenv("THRIFT_NO_SIMD") == NULL) {
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2")) l = BSWAP_SIMD_AVX2;
+         else if (__builtin_cpu_supports("ssse3")) l = BSWAP_SIMD_SSSE3;
+      }
+      __atomic_store_n(&level, l, __ATOMIC_RELAXED);
+   }
+   return l;
+}
+
+#define BSWAP_SSSE3_KERNEL(name, width, scalar, ...) \
+   __attribute__((target("ssse3"))) \
+   static void name(void *dst, const void *src, size_t n) { \
+      const __m128i mask = _mm_setr_epi8(__VA_ARGS__); \
+      const uint8_t *s = (const uint8_t *)src; \
+      uint8_t *d = (uint8_t *)dst; \
+      size_t per = 16 / (width); \
+      size_t i = 0; \
+      for (; i + per <= n; i += per) { \
+         __m128i v = _mm_loadu_si128((const __m128i *)(s + i * (width))); \
+         _mm_storeu_si128((__m128i *)(d + i * (width)), _mm_shuffle_epi8(v, mask)); \
+      } \
+      scalar(d + i * (width), s + i * (width), n - i); \
+   }
+
+#define BSWAP_AVX2_KERNEL(name, width, scalar, ...) \
+   __attribute__((target("avx2"))) \
+   static void name(void *dst, const void *src, size_t n) { \
+      const __m256i mask = _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__); \
+      const uint8_t *s = (const uint8_t *)src; \
+      uint8_t *d = (uint8_t *)dst; \
+      size_t per = 32 / (width); \
+      size_t i = 0; \
+      for (; i + per <= n; i += per) { \
+         __m256i v = _mm256_loadu_si256((const __m256i *)(s + i * (width))); \
+         _mm256_storeu_si256((__m256i *)(d + i * (width)), _mm256_shuffle_epi8(v, mask)); \
+      } \
+      scalar(d + i * (width), s + i * (width), n - i); \
+   }
+
+#define BSWAP16_MASK 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+#define BSWAP32_MASK 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define BSWAP64_MASK 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+BSWAP_SSSE3_KERNEL(thrift_bswap16_ssse3, 2, thrift_bswap16_scalar, BSWAP16_MASK)
+BSWAP_SSSE3_KERNEL(thrift_bswap32_ssse3, 4, thrift_bswap32_scalar, BSWAP32_MASK)
+BSWAP_SSSE3_KERNEL(thrift_bswap64_ssse3, 8, thrift_bswap64_scalar, BSWAP64_MASK)
+BSWAP_AVX2_KERNEL(thrift_bswap16_avx2, 2, thrift_bswap16_scalar, BSWAP16_MASK)
+BSWAP_AVX2_KERNEL(thrift_bswap32_avx2, 4, thrift_bswap32_scalar, BSWAP32_MASK)
+BSWAP_AVX2_KERNEL(thrift_bswap64_avx2, 8, thrift_bswap64_scalar, BSWAP64_MASK)
+
+#define BSWAP_DISPATCH(bits, dst, src, n) \
+   switch (thrift_bswap_simd_level()) { \
+      case BSWAP_SIMD_AVX2: thrift_bswap##bits##_avx2(dst, src, n); return; \
+      case BSWAP_SIMD_SSSE3: thrift_bswap##bits##_ssse3(dst, src, n); return; \
+      default: thrift_bswap##bits##_scalar(dst, src, n); return; \
+   }
+
+#elif defined(THRIFT_BSWAP_NOOP)
+
+#define BSWAP_DISPATCH(bits, dst, src, n) \
+   memcpy(dst, src, (n) * ((bits) / 8)); \
+   return;
+
+#else
+
+#define BSWAP_DISPATCH(bits, dst, src, n) \
+   thrift_bswap##bits##_scalar(dst, src, n); \
+   return;
+
+#endif
+
+// Converts n big-endian 16 bit values at src to host order at dst.
+// The conversion is its own inverse, so it also serves host to big-endian.
+static void thrift_bswap16(void *dst, const void *src, size_t n) {
+   BSWAP_DISPATCH(16, dst, src, n)
+}
+
+static void thrift_bswap32(void *dst, const void *src, size_t n) {
+   BSWAP_DISPATCH(32, dst, src, n)
+}
+
+static void thrift_bswap64(void *dst, const void *src, size_t n) {
+   BSWAP_DISPATCH(64, dst, src, n)
+}
+
+// Same as above for an array of width byte values that are stride elements
+// apart in src, written densely into dst. Unit strides take the vector path.
+static void thrift_bswap_strided(void *dst, const void *src, size_t n, size_t width, ptrdiff_t stride) {
+   if (stride == 1) {
+      switch (width) {
+         case 1: memcpy(dst, src, n); return;
+         case 2: thrift_bswap16(dst, src, n); return;
+         case 4: thrift_bswap32(dst, src, n); return;
+         case 8: thrift_bswap64(dst, src, n); return;
+      }
+   }
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   for (size_t i = 0; i < n; i++) {
+      const uint8_t *e = s + (ptrdiff_t)i * stride * (ptrdiff_t)width;
+      switch (width) {
+         case 1: d[i] = *e; break;
+         case 2: thrift_bswap16_scalar(d + i * width, e, 1); break;
+         case 4: thrift_bswap32_scalar(d + i * width, e, 1); break;
+         case 8: thrift_bswap64_scalar(d + i * width, e, 1); break;
+      }
+   }
+}
+
+// Same as above for values that are sstep bytes apart in src and dstep
+// bytes apart in dst, which splits the interleaved keys and values of map
+// entries into two arrays and gathers them back with one call per array.
+static void thrift_bswap_interleaved(void *dst, ptrdiff_t dstep, const void *src, ptrdiff_t sstep, size_t n, size_t width) {
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   switch (width) {
+      case 1:
+         for (size_t i = 0; i < n; i++) d[(ptrdiff_t)i * dstep] = s[(ptrdiff_t)i * sstep];
+         return;
+      case 2:
+         for (size_t i = 0; i < n; i++) thrift_bswap16_scalar(d + (ptrdiff_t)i * dstep, s + (ptrdiff_t)i * sstep, 1);
+         return;
+      case 4:
+         for (size_t i = 0; i < n; i++) thrift_bswap32_scalar(d + (ptrdiff_t)i * dstep, s + (ptrdiff_t)i * sstep, 1);
+         return;
+      case 8:
+         for (size_t i = 0; i < n; i++) thrift_bswap64_scalar(d + (ptrdiff_t)i * dstep, s + (ptrdiff_t)i * sstep, 1);
+         return;
+   }
+}
+
+// Little-endian <-> host conversion of n 64 bit values, which is a plain
+// copy everywhere but on big-endian hosts.
+static void thrift_copy_le64(void *dst, const void *src, size_t n) {
+#ifdef THRIFT_BSWAP_NOOP
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   for (size_t i = 0; i < n; i++) {
+      uint64_t v;
+      memcpy(&v, s + i * sizeof(v), sizeof(v));
+      v = letoh64(v);
+      memcpy(d + i * sizeof(v), &v, sizeof(v));
+   }
+#else
+   memcpy(dst, src, n * sizeof(uint64_t));
+#endif
+}
+
+static void thrift_copy_le64_strided(void *dst, const void *src, size_t n, ptrdiff_t stride) {
+   if (stride == 1) {
+      thrift_copy_le64(dst, src, n);
+      return;
+   }
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   for (size_t i = 0; i < n; i++) {
+      thrift_copy_le64(d + i * sizeof(uint64_t), s + (ptrdiff_t)i * stride * (ptrdiff_t)sizeof(uint64_t), 1);
+   }
+}
+
+static void thrift_copy_le64_interleaved(void *dst, ptrdiff_t dstep, const void *src, ptrdiff_t sstep, size_t n) {
+   const uint8_t *s = (const uint8_t *)src;
+   uint8_t *d = (uint8_t *)dst;
+   for (size_t i = 0; i < n; i++) {
+      thrift_copy_le64(d + (ptrdiff_t)i * dstep, s + (ptrdiff_t)i * sstep, 1);
+   }
+}
@@ -0,0 +1,927 @@
+//
+//  protocol.h
+//
+//  Wire level primitives for the Thrift binary and compact protocols.
+//  Everything in here works on a buffer_t cursor and reports failures as
+//  a negative errno, it never touches a lua_State. The Lua facing code in
+//  thrift.c builds values on top of these, and so can code that has to
+//  run without a Lua state.
+//
+#pragma once
+
+#include "endianutils.h"
+#include "bswaputils.h"
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define TTYPE_STOP   (0)
+#define TTYPE_VOID   (1)
+#define TTYPE_BOOL   (2)
+#define TTYPE_BYTE   (3)
+#define TTYPE_DOUBLE (4)
+#define TTYPE_I16    (6)
+#define TTYPE_I32    (8)
+#define TTYPE_I64    (10)
+#define TTYPE_STRING (11)
+#define TTYPE_STRUCT (12)
+#define TTYPE_MAP    (13)
+#define TTYPE_SET    (14)
+#define TTYPE_LIST   (15)
+#define TTYPE_ENUM   (16)
+
+#define PROTOCOL_BINARY  (0)
+#define PROTOCOL_COMPACT (1)
+
+#define CTYPE_STOP       (0)
+#define CTYPE_BOOL_TRUE  (1)
+#define CTYPE_BOOL_FALSE (2)
+#define CTYPE_BYTE       (3)
+#define CTYPE_I16        (4)
+#define CTYPE_I32        (5)
+#define CTYPE_I64        (6)
+#define CTYPE_DOUBLE     (7)
+#define CTYPE_BINARY     (8)
+#define CTYPE_LIST       (9)
+#define CTYPE_SET        (10)
+#define CTYPE_MAP        (11)
+#define CTYPE_STRUCT     (12)
+
+#define THRIFT_MAX_DEPTH (64)
+
+typedef struct buffer_t {
+   uint8_t *data;
+   size_t cb;
+   size_t max_cb;
+   int fixed;
+   uint8_t protocol;
+   // compact structs carry bool field values in the field header, this
+   // holds such a value (as a CTYPE_BOOL_*) until the bool itself is read
+   // or written, 0 when there is none
+   uint8_t pending_bool;
+   // whatever owns data when a caller can share it, opaque to the protocol
+   void *owner;
+} buffer_t;
+
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+// Makes room for cb more bytes. Fixed buffers wrap memory that is sized
+// up front (a Lua string or a ByteStorage) and can never move.
+static int buffer_reserve(buffer_t *b, size_t cb) {
+   if (b->cb + cb <= b->max_cb) return 0;
+   if (b->fixed) return -ENOSPC;
+   size_t max_cb = MAX(b->max_cb * 2, 256);
+   while (b->cb + cb > max_cb) max_cb *= 2;
+   uint8_t *data = (uint8_t *)realloc(b->data, max_cb);
+   if (data == NULL) return -ENOMEM;
+   b->data = data;
+   b->max_cb = max_cb;
+   return 0;
+}
+
+// Reads and writes that return a negative errno on failure.
+#define CREAD(dst, dstcb, b) \
+   if ((b)->max_cb - (b)->cb < (dstcb)) return -ENOMEM; \
+   memcpy((dst), (b)->data + (b)->cb, (dstcb)); \
+   (b)->cb += (dstcb);
+
+#define CREADN(dstcb, b) \
+   if ((b)->max_cb - (b)->cb < (dstcb)) return -ENOMEM; \
+   (b)->cb += (dstcb);
+
+#define CWRITE(src, srccb, b) \
+   if ((b)->cb + (srccb) > (b)->max_cb) { \
+      int ret = buffer_reserve((b), (srccb)); \
+      if (ret) return ret; \
+   } \
+   memcpy((b)->data + (b)->cb, (src), (srccb)); \
+   (b)->cb += (srccb);
+
+#define CTRY(expr) { \
+      int ret = (expr); \
+      if (ret) return ret; \
+   }
+
+static int thrift_is_scalar(uint8_t ttype) {
+   switch (ttype) {
+      case TTYPE_BOOL:
+      case TTYPE_BYTE:
+      case TTYPE_DOUBLE:
+      case TTYPE_I16:
+      case TTYPE_I32:
+      case TTYPE_ENUM:
+      case TTYPE_I64:
+         return 1;
+      default:
+         return 0;
+   }
+}
+
+// Encoded size of a fixed width type, 0 for variable width ones. Compact
+// integers are varints and so never fixed.
+static size_t proto_fixed_size(uint8_t protocol, uint8_t ttype) {
+   switch (ttype) {
+      case TTYPE_BOOL:
+      case TTYPE_BYTE:
+         return sizeof(uint8_t);
+      case TTYPE_DOUBLE:
+         return sizeof(double);
+      case TTYPE_I16:
+         return protocol == PROTOCOL_BINARY ? sizeof(int16_t) : 0;
+      case TTYPE_I32:
+      case TTYPE_ENUM:
+         return protocol == PROTOCOL_BINARY ? sizeof(int32_t) : 0;
+      case TTYPE_I64:
+         return protocol == PROTOCOL_BINARY ? sizeof(int64_t) : 0;
+      default:
+         return 0;
+   }
+}
+
+static int compact_to_ttype(uint8_t ctype, uint8_t *ttype) {
+   static const uint8_t ttypes[] = {
+      TTYPE_STOP, TTYPE_BOOL, TTYPE_BOOL, TTYPE_BYTE, TTYPE_I16, TTYPE_I32, TTYPE_I64,
+      TTYPE_DOUBLE, TTYPE_STRING, TTYPE_LIST, TTYPE_SET, TTYPE_MAP, TTYPE_STRUCT,
+   };
+   if (ctype >= sizeof(ttypes)) return -EINVAL;
+   *ttype = ttypes[ctype];
+   return 0;
+}
+
+static uint8_t ttype_to_compact(uint8_t ttype) {
+   switch (ttype) {
+      case TTYPE_BOOL: return CTYPE_BOOL_TRUE;
+      case TTYPE_BYTE: return CTYPE_BYTE;
+      case TTYPE_DOUBLE: return CTYPE_DOUBLE;
+      case TTYPE_I16: return CTYPE_I16;
+      case TTYPE_I32:
+      case TTYPE_ENUM: return CTYPE_I32;
+      case TTYPE_I64: return CTYPE_I64;
+      case TTYPE_STRING: return CTYPE_BINARY;
+      case TTYPE_STRUCT: return CTYPE_STRUCT;
+      case TTYPE_MAP: return CTYPE_MAP;
+      case TTYPE_SET: return CTYPE_SET;
+      case TTYPE_LIST: return CTYPE_LIST;
+      default: return CTYPE_STOP;
+   }
+}
+
+//
+// varints
+//
+
+static inline uint64_t zigzag_encode(int64_t v) {
+   return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+   return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int proto_read_varint(buffer_t *in, uint64_t *v) {
+   const uint8_t *p = in->data + in->cb;
+   size_t avail = in->max_cb - in->cb;
+   uint64_t r = 0;
+   for (size_t i = 0; i < 10; i++) {
+      if (i == avail) return -ENOMEM;
+      r |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+      if ((p[i] & 0x80) == 0) {
+         in->cb += i + 1;
+         *v = r;
+         return 0;
+      }
+   }
+   return -EINVAL;
+}
+
+static size_t varint_size(uint64_t v) {
+   size_t cb = 1;
+   while (v >= 0x80) {
+      v >>= 7;
+      cb++;
+   }
+   return cb;
+}
+
+static int proto_write_varint(buffer_t *out, uint64_t v) {
+   uint8_t bytes[10];
+   size_t cb = 0;
+   while (v >= 0x80) {
+      bytes[cb++] = (uint8_t)(v | 0x80);
+      v >>= 7;
+   }
+   bytes[cb++] = (uint8_t)v;
+   CWRITE(bytes, cb, out)
+   return 0;
+}
+
+// Decodes n zigzag varints into an array of width byte integers. Runs of
+// single byte varints, which dominate small ids and counts, are detected
+// eight at a time and decoded without the per byte loop.
+static int proto_read_varint_array(buffer_t *in, void *dst, size_t n, size_t width) {
+   uint8_t *d = (uint8_t *)dst;
+   size_t i = 0;
+   while (i < n) {
+      if (n - i >= 8 && in->max_cb - in->cb >= 8) {
+         uint64_t word;
+         memcpy(&word, in->data + in->cb, sizeof(word));
+         if ((word & 0x8080808080808080ULL) == 0) {
+            for (size_t j = 0; j < 8; j++) {
+               int64_t v = zigzag_decode(in->data[in->cb + j]);
+               switch (width) {
+                  case 2: { int16_t x = (int16_t)v; memcpy(d + (i + j) * width, &x, width); break; }
+                  case 4: { int32_t x = (int32_t)v; memcpy(d + (i + j) * width, &x, width); break; }
+                  default: memcpy(d + (i + j) * width, &v, width); break;
+               }
+            }
+            in->cb += 8;
+            i += 8;
+            continue;
+         }
+      }
+      uint64_t u;
+      CTRY(proto_read_varint(in, &u))
+      int64_t v = zigzag_decode(u);
+      switch (width) {
+         case 2: { int16_t x = (int16_t)v; memcpy(d + i * width, &x, width); break; }
+         case 4: { int32_t x = (int32_t)v; memcpy(d + i * width, &x, width); break; }
+         default: memcpy(d + i * width, &v, width); break;
+      }
+      i++;
+   }
+   return 0;
+}
+
+//
+// reading
+//
+
+// Reads the next field header of a struct. The type is TTYPE_STOP at the
+// end of the struct. last_fid tracks the previous field id for the compact
+// protocol's delta encoding and starts at 0 for every struct.
+static int proto_read_field_begin(buffer_t *in, uint8_t *ttype, uint16_t *fid, int16_t *last_fid) {
+   uint8_t b;
+   CREAD(&b, sizeof(b), in)
+   if (in->protocol == PROTOCOL_BINARY) {
+      *ttype = b;
+      if (b == TTYPE_STOP) return 0;
+      uint16_t i16;
+      CREAD(&i16, sizeof(i16), in)
+      *fid = betoh16(i16);
+      return 0;
+   }
+   if (b == CTYPE_STOP) {
+      *ttype = TTYPE_STOP;
+      return 0;
+   }
+   uint8_t ctype = b & 0x0f;
+   CTRY(compact_to_ttype(ctype, ttype))
+   if (*ttype == TTYPE_BOOL) in->pending_bool = ctype;
+   if (b >> 4) {
+      *last_fid += b >> 4;
+   } else {
+      uint64_t u;
+      CTRY(proto_read_varint(in, &u))
+      *last_fid = (int16_t)zigzag_decode(u);
+   }
+   *fid = (uint16_t)*last_fid;
+   return 0;
+}
+
+static int proto_read_list_begin(buffer_t *in, uint8_t *vt, int32_t *size) {
+   if (in->protocol == PROTOCOL_BINARY) {
+      CREAD(vt, sizeof(*vt), in)
+      int32_t i32;
+      CREAD(&i32, sizeof(i32), in)
+      *size = betoh32(i32);
+      return *size < 0 ? -EINVAL : 0;
+   }
+   uint8_t b;
+   CREAD(&b, sizeof(b), in)
+   CTRY(compact_to_ttype(b & 0x0f, vt))
+   if ((b >> 4) == 0x0f) {
+      uint64_t u;
+      CTRY(proto_read_varint(in, &u))
+      if (u > INT32_MAX) return -EINVAL;
+      *size = (int32_t)u;
+   } else {
+      *size = b >> 4;
+   }
+   return 0;
+}
+
+// Compact maps that are empty carry no key or value types, they come back
+// as TTYPE_STOP.
+static int proto_read_map_begin(buffer_t *in, uint8_t *kt, uint8_t *vt, int32_t *size) {
+   if (in->protocol == PROTOCOL_BINARY) {
+      CREAD(kt, sizeof(*kt), in)
+      CREAD(vt, sizeof(*vt), in)
+      int32_t i32;
+      CREAD(&i32, sizeof(i32), in)
+      *size = betoh32(i32);
+      return *size < 0 ? -EINVAL : 0;
+   }
+   uint64_t u;
+   CTRY(proto_read_varint(in, &u))
+   if (u > INT32_MAX) return -EINVAL;
+   *size = (int32_t)u;
+   *kt = *vt = TTYPE_STOP;
+   if (u == 0) return 0;
+   uint8_t b;
+   CREAD(&b, sizeof(b), in)
+   CTRY(compact_to_ttype(b >> 4, kt))
+   return compact_to_ttype(b & 0x0f, vt);
+}
+
+static int proto_read_bool(buffer_t *in, uint8_t *v) {
+   if (in->pending_bool) {
+      *v = in->pending_bool == CTYPE_BOOL_TRUE;
+      in->pending_bool = 0;
+      return 0;
+   }
+   uint8_t i8;
+   CREAD(&i8, sizeof(i8), in)
+   *v = in->protocol == PROTOCOL_BINARY ? i8 != 0 : i8 == CTYPE_BOOL_TRUE;
+   return 0;
+}
+
+static int proto_read_byte(buffer_t *in, uint8_t *v) {
+   CREAD(v, sizeof(*v), in)
+   return 0;
+}
+
+static int proto_read_i16(buffer_t *in, int16_t *v) {
+   if (in->protocol == PROTOCOL_BINARY) {
+      int16_t i16;
+      CREAD(&i16, sizeof(i16), in)
+      *v = betoh16(i16);
+      return 0;
+   }
+   uint64_t u;
+   CTRY(proto_read_varint(in, &u))
+   *v = (int16_t)zigzag_decode(u);
+   return 0;
+}
+
+static int proto_read_i32(buffer_t *in, int32_t *v) {
+   if (in->protocol == PROTOCOL_BINARY) {
+      int32_t i32;
+      CREAD(&i32, sizeof(i32), in)
+      *v = betoh32(i32);
+      return 0;
+   }
+   uint64_t u;
+   CTRY(proto_read_varint(in, &u))
+   *v = (int32_t)zigzag_decode(u);
+   return 0;
+}
+
+static int proto_read_i64(buffer_t *in, int64_t *v) {
+   if (in->protocol == PROTOCOL_BINARY) {
+      int64_t i64;
+      CREAD(&i64, sizeof(i64), in)
+      *v = betoh64(i64);
+      return 0;
+   }
+   uint64_t u;
+   CTRY(proto_read_varint(in, &u))
+   *v = zigzag_decode(u);
+   return 0;
+}
+
+// Binary doubles are big-endian, compact ones little-endian.
+static int proto_read_double(buffer_t *in, double *v) {
+   uint64_t i64;
+   CREAD(&i64, sizeof(i64), in)
+   i64 = in->protocol == PROTOCOL_BINARY ? betoh64(i64) : letoh64(i64);
+   memcpy(v, &i64, sizeof(i64));
+   return 0;
+}
+
+// Points str into the buffer, nothing is copied.
+static int proto_read_binary(buffer_t *in, const uint8_t **str, size_t *len) {
+   if (in->protocol == PROTOCOL_BINARY) {
+      int32_t i32;
+      CREAD(&i32, sizeof(i32), in)
+      i32 = betoh32(i32);
+      if (i32 < 0) return -EINVAL;
+      *len = i32;
+   } else {
+      uint64_t u;
+      CTRY(proto_read_varint(in, &u))
+      if (u > INT32_MAX) return -EINVAL;
+      *len = u;
+   }
+   *str = in->data + in->cb;
+   CREADN(*len, in)
+   return 0;
+}
+
+// Decodes any scalar, returns 1 when the value is a double and 0 when it
+// is an integer (bools and bytes included).
+static int proto_read_scalar(buffer_t *in, uint8_t ttype, int64_t *i64, double *d) {
+   switch (ttype) {
+      case TTYPE_BOOL: {
+         uint8_t b;
+         CTRY(proto_read_bool(in, &b))
+         *i64 = b;
+         return 0;
+      }
+      case TTYPE_BYTE: {
+         uint8_t i8;
+         CTRY(proto_read_byte(in, &i8))
+         *i64 = i8;
+         return 0;
+      }
+      case TTYPE_I16: {
+         int16_t i16;
+         CTRY(proto_read_i16(in, &i16))
+         *i64 = i16;
+         return 0;
+      }
+      case TTYPE_I32:
+      case TTYPE_ENUM: {
+         int32_t i32;
+         CTRY(proto_read_i32(in, &i32))
+         *i64 = i32;
+         return 0;
+      }
+      case TTYPE_I64:
+         return proto_read_i64(in, i64);
+      case TTYPE_DOUBLE: {
+         CTRY(proto_read_double(in, d))
+         return 1;
+      }
+      default:
+         return -EINVAL;
+   }
+}
+
+// Smallest possible encoding of n values of a type, used to reject bogus
+// container sizes before allocating for them.
+static size_t proto_min_size(uint8_t protocol, uint8_t ttype, size_t n) {
+   size_t fixed = proto_fixed_size(protocol, ttype);
+   return n * (fixed ? fixed : 1);
+}
+
+// Decodes n numeric values of the given type into a host order array of
+// their natural width (bytes, i16, i32, i64 or doubles).
+static int proto_read_array(buffer_t *in, uint8_t ttype, void *dst, size_t n) {
+   size_t fixed = proto_fixed_size(in->protocol, ttype);
+   if (fixed) {
+      const uint8_t *src = in->data + in->cb;
+      CREADN(n * fixed, in)
+      switch (fixed) {
+         case 1:
+            memcpy(dst, src, n);
+            return 0;
+         case 2:
+            thrift_bswap16(dst, src, n);
+            return 0;
+         case 4:
+            thrift_bswap32(dst, src, n);
+            return 0;
+         case 8:
+            if (in->protocol == PROTOCOL_BINARY) thrift_bswap64(dst, src, n);
+            else thrift_copy_le64(dst, src, n);
+            return 0;
+      }
+   }
+   switch (ttype) {
+      case TTYPE_I16: return proto_read_varint_array(in, dst, n, sizeof(int16_t));
+      case TTYPE_I32: return proto_read_varint_array(in, dst, n, sizeof(int32_t));
+      case TTYPE_I64: return proto_read_varint_array(in, dst, n, sizeof(int64_t));
+      default: return -EINVAL;
+   }
+}
+
+// Moves past a value of the given type by looking only at type tags and
+// lengths. Containers of fixed width values are skipped in one step.
+static int thrift_skip(buffer_t *in, uint8_t ttype, int depth) {
+   if (depth > THRIFT_MAX_DEPTH) return -ELOOP;
+   switch (ttype) {
+      case TTYPE_STOP:
+      case TTYPE_VOID:
+         return 0;
+      case TTYPE_BOOL: {
+         uint8_t b;
+         return proto_read_bool(in, &b);
+      }
+      case TTYPE_BYTE:
+      case TTYPE_DOUBLE:
+      case TTYPE_I16:
+      case TTYPE_I32:
+      case TTYPE_ENUM:
+      case TTYPE_I64: {
+         size_t fixed = proto_fixed_size(in->protocol, ttype);
+         if (fixed) {
+            CREADN(fixed, in)
+            return 0;
+         }
+         uint64_t u;
+         return proto_read_varint(in, &u);
+      }
+      case TTYPE_STRING: {
+         const uint8_t *str;
+         size_t len;
+         return proto_read_binary(in, &str, &len);
+      }
+      case TTYPE_STRUCT: {
+         uint8_t vt;
+         uint16_t fid;
+         int16_t last_fid = 0;
+         CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid))
+         while (vt != TTYPE_STOP) {
+            CTRY(thrift_skip(in, vt, depth + 1))
+            CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid))
+         }
+         return 0;
+      }
+      case TTYPE_MAP: {
+         uint8_t kt, vt;
+         int32_t size;
+         CTRY(proto_read_map_begin(in, &kt, &vt, &size))
+         size_t kcb = proto_fixed_size(in->protocol, kt), vcb = proto_fixed_size(in->protocol, vt);
+         if (kcb && vcb) {
+            CREADN((size_t)size * (kcb + vcb), in)
+            return 0;
+         }
+         for (int32_t i = 0; i < size; i++) {
+            CTRY(thrift_skip(in, kt, depth + 1))
+            CTRY(thrift_skip(in, vt, depth + 1))
+         }
+         return 0;
+      }
+      case TTYPE_SET:
+      case TTYPE_LIST: {
+         uint8_t vt;
+         int32_t size;
+         CTRY(proto_read_list_begin(in, &vt, &size))
+         size_t vcb = proto_fixed_size(in->protocol, vt);
+         if (vcb) {
+            CREADN((size_t)size * vcb, in)
+            return 0;
+         }
+         for (int32_t i = 0; i < size; i++) {
+            CTRY(thrift_skip(in, vt, depth + 1))
+         }
+         return 0;
+      }
+      default:
+         return -EINVAL;
+   }
+}
+
+//
+// writing
+//
+
+static int proto_write_field_begin(buffer_t *out, uint8_t ttype, uint16_t fid, int16_t *last_fid, int bool_value) {
+   if (out->protocol == PROTOCOL_BINARY) {
+      CWRITE(&ttype, sizeof(ttype), out)
+      uint16_t i16 = htobe16(fid);
+      CWRITE(&i16, sizeof(i16), out)
+      return 0;
+   }
+   uint8_t ctype = ttype_to_compact(ttype);
+   if (ttype == TTYPE_BOOL) {
+      ctype = bool_value ? CTYPE_BOOL_TRUE : CTYPE_BOOL_FALSE;
+      out->pending_bool = ctype;
+   }
+   int delta = (int16_t)fid - *last_fid;
+   if (delta > 0 && delta <= 15) {
+      uint8_t b = (uint8_t)(delta << 4) | ctype;
+      CWRITE(&b, sizeof(b), out)
+   } else {
+      CWRITE(&ctype, sizeof(ctype), out)
+      CTRY(proto_write_varint(out, zigzag_encode((int16_t)fid)))
+   }
+   *last_fid = (int16_t)fid;
+   return 0;
+}
+
+static int proto_write_field_stop(buffer_t *out) {
+   uint8_t b = TTYPE_STOP;
+   CWRITE(&b, sizeof(b), out)
+   return 0;
+}
+
+static int proto_write_list_begin(buffer_t *out, uint8_t vt, int32_t size) {
+   if (out->protocol == PROTOCOL_BINARY) {
+      CWRITE(&vt, sizeof(vt), out)
+      int32_t i32 = htobe32(size);
+      CWRITE(&i32, sizeof(i32), out)
+      return 0;
+   }
+   uint8_t ctype = ttype_to_compact(vt);
+   if (size < 15) {
+      uint8_t b = (uint8_t)(size << 4) | ctype;
+      CWRITE(&b, sizeof(b), out)
+      return 0;
+   }
+   uint8_t b = 0xf0 | ctype;
+   CWRITE(&b, sizeof(b), out)
+   return proto_write_varint(out, (uint32_t)size);
+}
+
+static int proto_write_map_begin(buffer_t *out, uint8_t kt, uint8_t vt, int32_t size) {
+   if (out->protocol == PROTOCOL_BINARY) {
+      CWRITE(&kt, sizeof(kt), out)
+      CWRITE(&vt, sizeof(vt), out)
+      int32_t i32 = htobe32(size);
+      CWRITE(&i32, sizeof(i32), out)
+      return 0;
+   }
+   CTRY(proto_write_varint(out, (uint32_t)size))
+   if (size == 0) return 0;
+   uint8_t b = (uint8_t)(ttype_to_compact(kt) << 4) | ttype_to_compact(vt);
+   CWRITE(&b, sizeof(b), out)
+   return 0;
+}
+
+static int proto_write_bool(buffer_t *out, int v) {
+   if (out->pending_bool) {
+      // already written as part of the compact field header
+      out->pending_bool = 0;
+      return 0;
+   }
+   uint8_t i8 = out->protocol == PROTOCOL_BINARY ? v != 0 : (v ? CTYPE_BOOL_TRUE : CTYPE_BOOL_FALSE);
+   CWRITE(&i8, sizeof(i8), out)
+   return 0;
+}
+
+static int proto_write_byte(buffer_t *out, uint8_t v) {
+   CWRITE(&v, sizeof(v), out)
+   return 0;
+}
+
+static int proto_write_i16(buffer_t *out, int16_t v) {
+   if (out->protocol == PROTOCOL_COMPACT) return proto_write_varint(out, zigzag_encode(v));
+   int16_t i16 = htobe16(v);
+   CWRITE(&i16, sizeof(i16), out)
+   return 0;
+}
+
+static int proto_write_i32(buffer_t *out, int32_t v) {
+   if (out->protocol == PROTOCOL_COMPACT) return proto_write_varint(out, zigzag_encode(v));
+   int32_t i32 = htobe32(v);
+   CWRITE(&i32, sizeof(i32), out)
+   return 0;
+}
+
+static int proto_write_i64(buffer_t *out, int64_t v) {
+   if (out->protocol == PROTOCOL_COMPACT) return proto_write_varint(out, zigzag_encode(v));
+   int64_t i64 = htobe64(v);
+   CWRITE(&i64, sizeof(i64), out)
+   return 0;
+}
+
+static int proto_write_double(buffer_t *out, double v) {
+   uint64_t i64;
+   memcpy(&i64, &v, sizeof(i64));
+   i64 = out->protocol == PROTOCOL_BINARY ? htobe64(i64) : htole64(i64);
+   CWRITE(&i64, sizeof(i64), out)
+   return 0;
+}
+
+static int proto_write_binary(buffer_t *out, const void *str, size_t len) {
+   if (len > INT32_MAX) return -EINVAL;
+   if (out->protocol == PROTOCOL_BINARY) {
+      int32_t i32 = htobe32((int32_t)len);
+      CWRITE(&i32, sizeof(i32), out)
+   } else {
+      CTRY(proto_write_varint(out, len))
+   }
+   CWRITE(str, len, out)
+   return 0;
+}
+
+static int64_t array_get_int(const uint8_t *p, size_t width) {
+   switch (width) {
+      case 2: { int16_t x; memcpy(&x, p, width); return x; }
+      case 4: { int32_t x; memcpy(&x, p, width); return x; }
+      default: { int64_t x; memcpy(&x, p, width); return x; }
+   }
+}
+
+static size_t array_width(uint8_t ttype) {
+   switch (ttype) {
+      case TTYPE_BYTE: return sizeof(uint8_t);
+      case TTYPE_I16: return sizeof(int16_t);
+      case TTYPE_I32: return sizeof(int32_t);
+      case TTYPE_I64: return sizeof(int64_t);
+      case TTYPE_DOUBLE: return sizeof(double);
+      default: return 0;
+   }
+}
+
+// Encodes n host order values of the given numeric type that sit stride
+// elements apart, the inverse of proto_read_array.
+static int proto_write_array(buffer_t *out, uint8_t ttype, const void *src, size_t n, ptrdiff_t stride) {
+   size_t width = array_width(ttype);
+   if (width == 0) return -EINVAL;
+   size_t fixed = proto_fixed_size(out->protocol, ttype);
+   if (fixed) {
+      CTRY(buffer_reserve(out, n * fixed))
+      if (fixed == 8 && out->protocol == PROTOCOL_COMPACT) {
+         thrift_copy_le64_strided(out->data + out->cb, src, n, stride);
+      } else {
+         thrift_bswap_strided(out->data + out->cb, src, n, fixed, stride);
+      }
+      out->cb += n * fixed;
+      return 0;
+   }
+   const uint8_t *s = (const uint8_t *)src;
+   CTRY(buffer_reserve(out, n))
+   for (size_t i = 0; i < n; i++) {
+      CTRY(proto_write_varint(out, zigzag_encode(array_get_int(s + (ptrdiff_t)i * stride * (ptrdiff_t)width, width))))
+   }
+   return 0;
+}
+
+// Converts n fixed width values between their wire and host order, sstep
+// bytes apart in src and dstep bytes apart in dst. Compact doubles are
+// little-endian, everything else is big-endian.
+static void proto_convert_interleaved(uint8_t protocol, void *dst, ptrdiff_t dstep, const void *src, ptrdiff_t sstep, size_t n, size_t fixed) {
+   if (fixed == 8 && protocol == PROTOCOL_COMPACT) thrift_copy_le64_interleaved(dst, dstep, src, sstep, n);
+   else thrift_bswap_interleaved(dst, dstep, src, sstep, n, fixed);
+}
+
+// Decodes n key value pairs of numeric types, interleaved as map entries
+// are on the wire, into two host order arrays. Entries of fixed width keys
+// and values are converted with one call for the keys and one for the
+// values, varints are decoded entry by entry.
+static int proto_read_pairs(buffer_t *in, uint8_t kt, void *keys, uint8_t vt, void *values, size_t n) {
+   size_t kw = array_width(kt), vw = array_width(vt);
+   size_t kf = proto_fixed_size(in->protocol, kt), vf = proto_fixed_size(in->protocol, vt);
+   if (kw && vw && kf && vf) {
+      const uint8_t *src = in->data + in->cb;
+      CREADN(n * (kf + vf), in)
+      proto_convert_interleaved(in->protocol, keys, kw, src, kf + vf, n, kf);
+      proto_convert_interleaved(in->protocol, values, vw, src + kf, kf + vf, n, vf);
+      return 0;
+   }
+   for (size_t i = 0; i < n; i++) {
+      CTRY(proto_read_array(in, kt, (uint8_t *)keys + i * kw, 1))
+      CTRY(proto_read_array(in, vt, (uint8_t *)values + i * vw, 1))
+   }
+   return 0;
+}
+
+// The inverse of proto_read_pairs for arrays with the given strides.
+static int proto_write_pairs(buffer_t *out, uint8_t kt, const void *keys, ptrdiff_t kstride, uint8_t vt, const void *values, ptrdiff_t vstride, size_t n) {
+   size_t kw = array_width(kt), vw = array_width(vt);
+   size_t kf = proto_fixed_size(out->protocol, kt), vf = proto_fixed_size(out->protocol, vt);
+   if (kw && vw && kf && vf) {
+      CTRY(buffer_reserve(out, n * (kf + vf)))
+      uint8_t *dst = out->data + out->cb;
+      proto_convert_interleaved(out->protocol, dst, kf + vf, keys, kstride * (ptrdiff_t)kw, n, kf);
+      proto_convert_interleaved(out->protocol, dst + kf, kf + vf, values, vstride * (ptrdiff_t)vw, n, vf);
+      out->cb += n * (kf + vf);
+      return 0;
+   }
+   for (size_t i = 0; i < n; i++) {
+      CTRY(proto_write_array(out, kt, (const uint8_t *)keys + (ptrdiff_t)i * kstride * (ptrdiff_t)kw, 1, 1))
+      CTRY(proto_write_array(out, vt, (const uint8_t *)values + (ptrdiff_t)i * vstride * (ptrdiff_t)vw, 1, 1))
+   }
+   return 0;
+}
+
+//
+// sizes, these mirror the writers above for computing exact encoded sizes
+//
+
+static size_t proto_size_field_begin(uint8_t protocol, uint16_t fid, int16_t *last_fid) {
+   if (protocol == PROTOCOL_BINARY) return sizeof(uint8_t) + sizeof(int16_t);
+   int delta = (int16_t)fid - *last_fid;
+   *last_fid = (int16_t)fid;
+   if (delta > 0 && delta <= 15) return sizeof(uint8_t);
+   return sizeof(uint8_t) + varint_size(zigzag_encode((int16_t)fid));
+}
+
+static size_t proto_size_list_begin(uint8_t protocol, int32_t size) {
+   if (protocol == PROTOCOL_BINARY) return sizeof(uint8_t) + sizeof(int32_t);
+   return size < 15 ? sizeof(uint8_t) : sizeof(uint8_t) + varint_size((uint32_t)size);
+}
+
+static size_t proto_size_map_begin(uint8_t protocol, int32_t size) {
+   if (protocol == PROTOCOL_BINARY) return 2 * sizeof(uint8_t) + sizeof(int32_t);
+   return varint_size((uint32_t)size) + (size ? sizeof(uint8_t) : 0);
+}
+
+// Size of an integer, bool or double value of the given type.
+static size_t proto_size_scalar(uint8_t protocol, uint8_t ttype, int64_t v) {
+   size_t fixed = proto_fixed_size(protocol, ttype);
+   return fixed ? fixed : varint_size(zigzag_encode(v));
+}
+
+static size_t proto_size_binary(uint8_t protocol, size_t len) {
+   if (protocol == PROTOCOL_BINARY) return sizeof(int32_t) + len;
+   return varint_size(len) + len;
+}
+
+static size_t proto_size_array(uint8_t protocol, uint8_t ttype, const void *src, size_t n, ptrdiff_t stride) {
+   size_t width = array_width(ttype);
+   size_t fixed = proto_fixed_size(protocol, ttype);
+   if (fixed) return n * fixed;
+   const uint8_t *s = (const uint8_t *)src;
+   size_t size = 0;
+   for (size_t i = 0; i < n; i++) {
+      size += varint_size(zigzag_encode(array_get_int(s + (ptrdiff_t)i * stride * (ptrdiff_t)width, width)));
+   }
+   return size;
+}
+
+//
+// transcoding
+//
+
+// Copies one value of the given type from in to out, converting between
+// the protocols of the two buffers along the way.
+static int proto_transcode(buffer_t *in, buffer_t *out, uint8_t ttype, int depth) {
+   if (depth > THRIFT_MAX_DEPTH) return -ELOOP;
+   switch (ttype) {
+      case TTYPE_BOOL: {
+         uint8_t v;
+         CTRY(proto_read_bool(in, &v))
+         return proto_write_bool(out, v);
+      }
+      case TTYPE_BYTE: {
+         uint8_t v;
+         CTRY(proto_read_byte(in, &v))
+         return proto_write_byte(out, v);
+      }
+      case TTYPE_I16: {
+         int16_t v;
+         CTRY(proto_read_i16(in, &v))
+         return proto_write_i16(out, v);
+      }
+      case TTYPE_I32:
+      case TTYPE_ENUM: {
+         int32_t v;
+         CTRY(proto_read_i32(in, &v))
+         return proto_write_i32(out, v);
+      }
+      case TTYPE_I64: {
+         int64_t v;
+         CTRY(proto_read_i64(in, &v))
+         return proto_write_i64(out, v);
+      }
+      case TTYPE_DOUBLE: {
+         double v;
+         CTRY(proto_read_double(in, &v))
+         return proto_write_double(out, v);
+      }
+      case TTYPE_STRING: {
+         const uint8_t *str;
+         size_t len;
+         CTRY(proto_read_binary(in, &str, &len))
+         return proto_write_binary(out, str, len);
+      }
+      case TTYPE_STRUCT: {
+         int16_t in_fid = 0, out_fid = 0;
+         uint8_t vt;
+         uint16_t fid;
+         CTRY(proto_read_field_begin(in, &vt, &fid, &in_fid))
+         while (vt != TTYPE_STOP) {
+            if (vt == TTYPE_BOOL) {
+               uint8_t v;
+               CTRY(proto_read_bool(in, &v))
+               CTRY(proto_write_field_begin(out, vt, fid, &out_fid, v))
+               CTRY(proto_write_bool(out, v))
+            } else {
+               CTRY(proto_write_field_begin(out, vt, fid, &out_fid, 0))
+               CTRY(proto_transcode(in, out, vt, depth + 1))
+            }
+            CTRY(proto_read_field_begin(in, &vt, &fid, &in_fid))
+         }
+         return proto_write_field_stop(out);
+      }
+      case TTYPE_MAP: {
+         uint8_t kt, vt;
+         int32_t size;
+         CTRY(proto_read_map_begin(in, &kt, &vt, &size))
+         CTRY(proto_write_map_begin(out, kt, vt, size))
+         for (int32_t i = 0; i < size; i++) {
+            CTRY(proto_transcode(in, out, kt, depth + 1))
+            CTRY(proto_transcode(in, out, vt, depth + 1))
+         }
+         return 0;
+      }
+      case TTYPE_SET:
+      case TTYPE_LIST: {
+         uint8_t vt;
+         int32_t size;
+         CTRY(proto_read_list_begin(in, &vt, &size))
+         CTRY(proto_write_list_begin(out, vt, size))
+         for (int32_t i = 0; i < size; i++) {
+            CTRY(proto_transcode(in, out, vt, depth + 1))
+         }
+         return 0;
+      }
+      default:
+         return -EINVAL;
+   }
+}
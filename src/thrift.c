@@ -1,26 +1,20 @@
 #include <TH/TH.h>
 #include "luaT.h"
-#include "endianutils.h"
+#include "protocol.h"
+#include "block.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
-
-#define TTYPE_STOP   (0)
-#define TTYPE_VOID   (1)
-#define TTYPE_BOOL   (2)
-#define TTYPE_BYTE   (3)
-#define TTYPE_DOUBLE (4)
-#define TTYPE_I16    (6)
-#define TTYPE_I32    (8)
-#define TTYPE_I64    (10)
-#define TTYPE_STRING (11)
-#define TTYPE_STRUCT (12)
-#define TTYPE_MAP    (13)
-#define TTYPE_SET    (14)
-#define TTYPE_LIST   (15)
-#define TTYPE_ENUM   (16)
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 static int _lua_error(lua_State *L, int ret, const char* file, int line) {
    int pos_ret = ret < 0 ? -ret : ret;
@@ -50,52 +44,186 @@ static int thrift_ttype(lua_State *L, const char *sz) {
    else return LUA_HANDLE_ERROR(L, EINVAL);
 }
 
-typedef struct buffer_t {
-   uint8_t *data;
-   size_t cb;
-   size_t max_cb;
-} buffer_t;
-
-#define MAX(a,b) (((a)>(b))?(a):(b))
-
-#define WRITE(L, src, srccb, b) \
-   while ((b)->cb + (srccb) > (b)->max_cb) { \
-      (b)->max_cb = MAX((b)->max_cb * 2, 256); \
-      (b)->data = (uint8_t *)realloc((b)->data, (b)->max_cb); \
-   } \
-   memcpy((b)->data + (b)->cb, (src), (srccb)); \
-   (b)->cb += (srccb);
-
-#define READ(L, dst, dstcb, b) \
-   if ((b)->max_cb - (b)->cb < (dstcb)) return LUA_HANDLE_ERROR(L, ENOMEM); \
-   memcpy((dst), (b)->data + (b)->cb, (dstcb)); \
-   (b)->cb += (dstcb);
-
-#define READN(L, dstcb, b) \
-   if ((b)->max_cb - (b)->cb < (dstcb)) return LUA_HANDLE_ERROR(L, ENOMEM); \
-   (b)->cb += (dstcb);
+#define TRY(L, expr) { \
+      int ret = (expr); \
+      if (ret) return LUA_HANDLE_ERROR(L, ret); \
+   }
 
 #define I64_AS_NUMBER            (0)
 #define I64_AS_STRING            (1)
 #define I64_AS_TENSOR            (2)
 #define I64_AS_MASK              (3)
 #define LIST_AND_SET_AS_TENSOR   (4)
+#define PROJECTION               (8)
+#define COMPACT_PROTOCOL         (16)
+#define ARRAY_FIELDS             (32)
+#define STATS                    (64)
+#define STRINGS_AS_TENSORS       (128)
+#define MAP_AS_TENSORS           (256)
+
+#define THRIFT_MAX_THREADS       (256)
+
+#define SHAPE_NONE               (0)
+#define SHAPE_FIXED              (1)
+#define SHAPE_RAGGED             (2)
+#define SHAPE_COLUMNS            (3)
+
+#define THRIFT_PROTOCOL(flags) (((flags) & COMPACT_PROTOCOL) ? PROTOCOL_COMPACT : PROTOCOL_BINARY)
 
 typedef struct desc_t {
    struct desc_t *key_ttype;
    struct desc_t *value_ttype;
    struct desc_t *fields;
+   uint16_t *field_index;
    uint16_t num_fields;
    uint16_t field_id;
+   uint16_t field_index_base;
+   uint16_t field_index_size;
    uint8_t ttype;
+   uint8_t fixed_size;
+   uint16_t threads;
+   uint16_t table_narr;
+   uint16_t table_nrec;
+   uint8_t shape;
+   uint8_t shape_levels;
+   uint8_t shape_ttype;
    int flags;
+   int name_ref;
    const char *field_name;
+   struct stats_t *stats;
 } desc_t;
 
+// A codec owns its schema. The root desc sits in the codec userdata and
+// every other node of the schema in one arena. readInto marks the fields
+// it reads in seen, indexed by the position of their node in the arena.
+typedef struct codec_t {
+   desc_t desc;
+   uint8_t *arena;
+   struct stats_t *stats;
+   uint8_t *seen;
+} codec_t;
+
+// Counters of a codec created with the stats option. Every node of its
+// schema points at them, field counters are indexed by the position of
+// the field's node in the arena.
+typedef struct value_stats_t {
+   uint64_t count;
+   uint64_t bytes;
+   uint64_t ns;
+} value_stats_t;
+
+typedef struct stats_t {
+   uint64_t records_read;
+   uint64_t records_written;
+   uint64_t bytes_read;
+   uint64_t bytes_written;
+   uint64_t allocations;
+   value_stats_t ttypes[TTYPE_ENUM + 1];
+   desc_t *nodes;
+   size_t num_nodes;
+   value_stats_t fields[];
+} stats_t;
+
 static int _compare(const void *a, const void *b) {
    return (int)((desc_t *)a)->field_id - (int)((desc_t *)b)->field_id;
 }
 
+// Struct fields with ids that are reasonably dense get a direct table from
+// field id to position in desc->fields, sparse ones fall back to a binary
+// search over the sorted fields.
+#define FIELD_INDEX_SLACK (64)
+
+static void thrift_desc_index(desc_t *desc) {
+   if (desc->num_fields == 0) return;
+   uint16_t base = desc->fields[0].field_id;
+   uint32_t range = (uint32_t)desc->fields[desc->num_fields - 1].field_id - base + 1;
+   if (range > 4 * (uint32_t)desc->num_fields + FIELD_INDEX_SLACK) return;
+   desc->field_index = (uint16_t *)calloc(range, sizeof(uint16_t));
+   desc->field_index_base = base;
+   desc->field_index_size = range;
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      desc->field_index[desc->fields[i].field_id - base] = i + 1;
+   }
+}
+
+// Finds the field with the given id. The hint is the position one past the
+// previous match, so fields that arrive in schema order hit on the first try.
+static desc_t *thrift_desc_field(desc_t *desc, uint16_t fid, uint16_t *hint) {
+   uint16_t i = *hint;
+   if (i < desc->num_fields && desc->fields[i].field_id == fid) {
+      *hint = i + 1;
+      return &desc->fields[i];
+   }
+   if (desc->field_index) {
+      uint16_t slot = fid - desc->field_index_base;
+      if (fid < desc->field_index_base || slot >= desc->field_index_size || desc->field_index[slot] == 0) return NULL;
+      i = desc->field_index[slot];
+      *hint = i;
+      return &desc->fields[i - 1];
+   }
+   uint16_t lo = 0, hi = desc->num_fields;
+   while (lo < hi) {
+      uint16_t mid = lo + (hi - lo) / 2;
+      if (desc->fields[mid].field_id < fid) lo = mid + 1;
+      else hi = mid;
+   }
+   if (lo == desc->num_fields || desc->fields[lo].field_id != fid) return NULL;
+   *hint = lo + 1;
+   return &desc->fields[lo];
+}
+
+// Finds the field of a struct desc named by the first len bytes of key,
+// which is either a field name or a numeric field id.
+static desc_t *thrift_desc_find(desc_t *desc, const char *key, size_t len) {
+   char *num_end;
+   long fid = strtol(key, &num_end, 10);
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      const char *name = desc->fields[i].field_name;
+      if ((name && strncmp(name, key, len) == 0 && name[len] == 0) ||
+          (len > 0 && num_end == key + len && desc->fields[i].field_id == fid)) {
+         return &desc->fields[i];
+      }
+   }
+   return NULL;
+}
+
+// Counts the levels of nested lists under a shaped list and finds the type
+// of their elements, -ELOOP when they nest too deeply.
+static int thrift_shape_levels(const desc_t *desc, uint8_t *levels, uint8_t *ttype) {
+   const desc_t *level = desc;
+   *levels = 1;
+   while (level->value_ttype->ttype == TTYPE_LIST || level->value_ttype->ttype == TTYPE_SET) {
+      level = level->value_ttype;
+      if (++*levels == THRIFT_MAX_DEPTH) return -ELOOP;
+   }
+   *ttype = level->value_ttype->ttype;
+   return 0;
+}
+
+// Nested lists of numbers can read and write as one tensor, either of a
+// fixed shape with a dimension per level or as the flat values and offsets
+// of ragged rows, which only have two levels. Lists of structs can read
+// and write as columns, one tensor per field.
+static int thrift_desc_shape(lua_State *L, desc_t *desc, const char *shape) {
+   if (strcmp(shape, "fixed") == 0) desc->shape = SHAPE_FIXED;
+   else if (strcmp(shape, "ragged") == 0) desc->shape = SHAPE_RAGGED;
+   else if (strcmp(shape, "columns") == 0) desc->shape = SHAPE_COLUMNS;
+   else return LUA_HANDLE_ERROR_STR(L, "unknown shape");
+   // lists of structs of scalars read and write as a tensor per field
+   if (desc->shape == SHAPE_COLUMNS) {
+      desc_t *item = desc->value_ttype;
+      if (item->ttype != TTYPE_STRUCT) return LUA_HANDLE_ERROR_STR(L, "columns need a list of structs");
+      for (uint16_t i = 0; i < item->num_fields; i++) {
+         if (!thrift_is_scalar(item->fields[i].ttype)) return LUA_HANDLE_ERROR_STR(L, "columns need structs of scalar fields");
+      }
+      return 0;
+   }
+   TRY(L, thrift_shape_levels(desc, &desc->shape_levels, &desc->shape_ttype))
+   if (array_width(desc->shape_ttype) == 0) return LUA_HANDLE_ERROR_STR(L, "shaped lists need numeric elements");
+   if (desc->shape == SHAPE_RAGGED && desc->shape_levels != 2) return LUA_HANDLE_ERROR_STR(L, "ragged lists need exactly two levels");
+   return 0;
+}
+
 static int thrift_desc_rcsv(lua_State *L, int index, desc_t *desc) {
    if (lua_type(L, index) == LUA_TSTRING) {
       desc->ttype = thrift_ttype(L, lua_tostring(L, index));
@@ -119,6 +247,53 @@ static int thrift_desc_rcsv(lua_State *L, int index, desc_t *desc) {
          desc->flags |= LIST_AND_SET_AS_TENSOR;
       }
       lua_pop(L, 1);
+      lua_pushstring(L, "projection");
+      lua_gettable(L, index);
+      if (lua_toboolean(L, lua_gettop(L))) {
+         desc->flags |= PROJECTION;
+      }
+      lua_pop(L, 1);
+      lua_pushstring(L, "arrayFields");
+      lua_gettable(L, index);
+      if (lua_toboolean(L, lua_gettop(L))) {
+         desc->flags |= ARRAY_FIELDS;
+      }
+      lua_pop(L, 1);
+      lua_pushstring(L, "mapsAsTensors");
+      lua_gettable(L, index);
+      if (lua_toboolean(L, lua_gettop(L))) {
+         desc->flags |= MAP_AS_TENSORS;
+      }
+      lua_pop(L, 1);
+      lua_pushstring(L, "stringsAsTensors");
+      lua_gettable(L, index);
+      if (lua_toboolean(L, lua_gettop(L))) {
+         desc->flags |= STRINGS_AS_TENSORS;
+      }
+      lua_pop(L, 1);
+      lua_pushstring(L, "stats");
+      lua_gettable(L, index);
+      if (lua_toboolean(L, lua_gettop(L))) {
+         desc->flags |= STATS;
+      }
+      lua_pop(L, 1);
+      lua_pushstring(L, "protocol");
+      lua_gettable(L, index);
+      const char *protocol = lua_tostring(L, lua_gettop(L));
+      if (protocol && strcmp(protocol, "compact") == 0) {
+         desc->flags |= COMPACT_PROTOCOL;
+      } else if (protocol && strcmp(protocol, "binary") != 0) {
+         return LUA_HANDLE_ERROR_STR(L, "unknown protocol");
+      }
+      lua_pop(L, 1);
+      lua_pushstring(L, "threads");
+      lua_gettable(L, index);
+      if (!lua_isnil(L, lua_gettop(L))) {
+         lua_Integer threads = lua_tointeger(L, lua_gettop(L));
+         if (threads < 1 || threads > THRIFT_MAX_THREADS) return LUA_HANDLE_ERROR_STR(L, "threads out of range");
+         desc->threads = threads;
+      }
+      lua_pop(L, 1);
       lua_pushstring(L, "ttype");
       lua_gettable(L, index);
       if (lua_type(L, lua_gettop(L)) == LUA_TNIL) {
@@ -151,6 +326,7 @@ static int thrift_desc_rcsv(lua_State *L, int index, desc_t *desc) {
                desc->num_fields++;
             }
             qsort(desc->fields, desc->num_fields, sizeof(desc_t), _compare);
+            thrift_desc_index(desc);
             lua_pop(L, 1);
             return 0;
          case TTYPE_MAP:
@@ -172,6 +348,11 @@ static int thrift_desc_rcsv(lua_State *L, int index, desc_t *desc) {
             desc->value_ttype = calloc(1, sizeof(desc_t));
             thrift_desc_rcsv(L, lua_gettop(L), desc->value_ttype);
             lua_pop(L, 1);
+            lua_pushstring(L, "shape");
+            lua_gettable(L, index);
+            const char *shape = lua_tostring(L, lua_gettop(L));
+            if (shape) thrift_desc_shape(L, desc, shape);
+            lua_pop(L, 1);
             return 0;
       }
       return 0;
@@ -179,19 +360,6 @@ static int thrift_desc_rcsv(lua_State *L, int index, desc_t *desc) {
    return LUA_HANDLE_ERROR_STR(L, "expected a string or a table");
 }
 
-static int thrift_desc(lua_State *L) {
-   desc_t *desc = (desc_t *)lua_newuserdata(L, sizeof(desc_t));
-   memset(desc, 0, sizeof(desc_t));
-   if (lua_gettop(L) > 1) {
-      thrift_desc_rcsv(L, 1, desc);
-   } else {
-      desc->ttype = TTYPE_STRUCT;
-   }
-   luaL_getmetatable(L, "thrift.codec");
-   lua_setmetatable(L, -2);
-   return 1;
-}
-
 static void thrift_destroy_desc_rcsv(desc_t *desc) {
    if (desc->key_ttype) {
       thrift_destroy_desc_rcsv(desc->key_ttype);
@@ -205,87 +373,438 @@ static void thrift_destroy_desc_rcsv(desc_t *desc) {
       thrift_destroy_desc_rcsv(&desc->fields[i]);
    }
    free(desc->fields);
+   free(desc->field_index);
    free((void *)desc->field_name);
 }
 
+static void thrift_desc_unref_names(lua_State *L, desc_t *desc) {
+   luaL_unref(L, LUA_REGISTRYINDEX, desc->name_ref);
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      thrift_desc_unref_names(L, &desc->fields[i]);
+   }
+   if (desc->key_ttype) thrift_desc_unref_names(L, desc->key_ttype);
+   if (desc->value_ttype) thrift_desc_unref_names(L, desc->value_ttype);
+}
+
 static int thrift_gc(lua_State *L) {
-   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
-   thrift_destroy_desc_rcsv(desc);
+   codec_t *codec = (codec_t *)lua_touserdata(L, 1);
+   if (codec->arena) {
+      thrift_desc_unref_names(L, &codec->desc);
+      free(codec->arena);
+      free(codec->stats);
+      free(codec->seen);
+   } else {
+      thrift_destroy_desc_rcsv(&codec->desc);
+   }
    return 0;
 }
 
-static int thrift_read_rcsv(lua_State *L, uint8_t ttype, buffer_t *in, int flags, desc_t *desc, void *out) {
-   switch (ttype) {
-      case TTYPE_STOP:
-         return 0;
+// Schemas are parsed into a tree of separately allocated nodes, which is
+// then compiled into a single arena. The nodes are laid out depth first
+// with the fields of a struct next to each other, followed by the field
+// index tables and the field names.
+typedef struct arena_t {
+   desc_t *nodes;
+   uint16_t *indices;
+   char *names;
+} arena_t;
+
+static void thrift_desc_measure(const desc_t *desc, size_t *nodes, size_t *indices, size_t *names) {
+   if (desc->field_index) *indices += desc->field_index_size;
+   if (desc->field_name) *names += strlen(desc->field_name) + 1;
+   *nodes += desc->num_fields + (desc->key_ttype != NULL) + (desc->value_ttype != NULL);
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      thrift_desc_measure(&desc->fields[i], nodes, indices, names);
+   }
+   if (desc->key_ttype) thrift_desc_measure(desc->key_ttype, nodes, indices, names);
+   if (desc->value_ttype) thrift_desc_measure(desc->value_ttype, nodes, indices, names);
+}
+
+// Sizes the tables structs are read into. Named fields always go into the
+// hash part. Unnamed ones do too, unless the arrayFields option is set and
+// their ids are dense enough for Lua to keep them in the array part.
+static void thrift_desc_table_size(desc_t *desc, int flags) {
+   uint16_t unnamed = 0, max_fid = 0;
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      if (desc->fields[i].field_name == NULL) {
+         unnamed++;
+         max_fid = MAX(max_fid, desc->fields[i].field_id);
+      }
+   }
+   desc->table_narr = 0;
+   desc->table_nrec = desc->num_fields;
+   if ((flags & ARRAY_FIELDS) && unnamed > 0 && max_fid <= 2 * (uint32_t)unnamed) {
+      desc->table_narr = max_fid;
+      desc->table_nrec = desc->num_fields - unnamed;
+   }
+}
+
+static void thrift_desc_compile_rcsv(desc_t *dst, const desc_t *src, arena_t *arena, int flags) {
+   *dst = *src;
+   dst->fixed_size = proto_fixed_size(THRIFT_PROTOCOL(flags), src->ttype);
+   dst->name_ref = LUA_NOREF;
+   thrift_desc_table_size(dst, flags);
+   if (src->field_name) {
+      size_t len = strlen(src->field_name) + 1;
+      memcpy(arena->names, src->field_name, len);
+      dst->field_name = arena->names;
+      arena->names += len;
+   }
+   if (src->field_index) {
+      memcpy(arena->indices, src->field_index, src->field_index_size * sizeof(uint16_t));
+      dst->field_index = arena->indices;
+      arena->indices += src->field_index_size;
+   }
+   if (src->num_fields) {
+      dst->fields = arena->nodes;
+      arena->nodes += src->num_fields;
+      for (uint16_t i = 0; i < src->num_fields; i++) {
+         thrift_desc_compile_rcsv(&dst->fields[i], &src->fields[i], arena, flags);
+      }
+   }
+   if (src->key_ttype) {
+      dst->key_ttype = arena->nodes++;
+      thrift_desc_compile_rcsv(dst->key_ttype, src->key_ttype, arena, flags);
+   }
+   if (src->value_ttype) {
+      dst->value_ttype = arena->nodes++;
+      thrift_desc_compile_rcsv(dst->value_ttype, src->value_ttype, arena, flags);
+   }
+}
+
+static int thrift_desc_compile(codec_t *codec) {
+   size_t nodes = 0, indices = 0, names = 0;
+   thrift_desc_measure(&codec->desc, &nodes, &indices, &names);
+   uint8_t *arena = (uint8_t *)malloc(MAX(nodes * sizeof(desc_t) + indices * sizeof(uint16_t) + names, 1));
+   if (arena == NULL) return -ENOMEM;
+   arena_t next;
+   next.nodes = (desc_t *)arena;
+   next.indices = (uint16_t *)(next.nodes + nodes);
+   next.names = (char *)(next.indices + indices);
+   desc_t tree = codec->desc;
+   thrift_desc_compile_rcsv(&codec->desc, &tree, &next, tree.flags);
+   thrift_destroy_desc_rcsv(&tree);
+   codec->arena = arena;
+   return 0;
+}
+
+// Field names are interned once per codec and kept in the registry, so
+// reading and writing records does not hash them again.
+static void thrift_desc_ref_names(lua_State *L, desc_t *desc) {
+   if (desc->field_name) {
+      lua_pushstring(L, desc->field_name);
+      desc->name_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+   }
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      thrift_desc_ref_names(L, &desc->fields[i]);
+   }
+   if (desc->key_ttype) thrift_desc_ref_names(L, desc->key_ttype);
+   if (desc->value_ttype) thrift_desc_ref_names(L, desc->value_ttype);
+}
+
+static void thrift_desc_set_stats(desc_t *desc, stats_t *stats) {
+   desc->stats = stats;
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      thrift_desc_set_stats(&desc->fields[i], stats);
+   }
+   if (desc->key_ttype) thrift_desc_set_stats(desc->key_ttype, stats);
+   if (desc->value_ttype) thrift_desc_set_stats(desc->value_ttype, stats);
+}
+
+static int thrift_desc_stats(codec_t *codec) {
+   size_t nodes = 0, indices = 0, names = 0;
+   thrift_desc_measure(&codec->desc, &nodes, &indices, &names);
+   codec->stats = (stats_t *)calloc(1, sizeof(stats_t) + nodes * sizeof(value_stats_t));
+   if (codec->stats == NULL) return -ENOMEM;
+   codec->stats->nodes = (desc_t *)codec->arena;
+   codec->stats->num_nodes = nodes;
+   thrift_desc_set_stats(&codec->desc, codec->stats);
+   return 0;
+}
+
+static int thrift_desc(lua_State *L) {
+   codec_t *codec = (codec_t *)lua_newuserdata(L, sizeof(codec_t));
+   memset(codec, 0, sizeof(codec_t));
+   // collectable before parsing, so a bad schema frees what was built of it
+   luaL_getmetatable(L, "thrift.codec");
+   lua_setmetatable(L, -2);
+   if (lua_gettop(L) > 1) {
+      thrift_desc_rcsv(L, 1, &codec->desc);
+   } else {
+      codec->desc.ttype = TTYPE_STRUCT;
+   }
+   TRY(L, thrift_desc_compile(codec))
+   thrift_desc_ref_names(L, &codec->desc);
+   if (codec->desc.flags & STATS) TRY(L, thrift_desc_stats(codec))
+   return 1;
+}
+
+// A compiled codec serializes to its root node and arena, with pointers
+// stored as offsets into the arena plus one so NULL stays NULL. Blobs use
+// the host's byte order and struct layout, so they only load into the same
+// build of the library, which the header checks.
+#define THRIFT_BLOB_MAGIC   (0x43524854)
+#define THRIFT_BLOB_VERSION (1)
+
+typedef struct blob_header_t {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t desc_size;
+   uint32_t nodes;
+   uint32_t indices;
+   uint32_t names;
+} blob_header_t;
+
+#define BLOB_PACK(p, arena) ((p) ? (void *)((uintptr_t)((const uint8_t *)(p) - (arena)) + 1) : NULL)
+
+static void thrift_blob_pack(desc_t *dst, const desc_t *src, const uint8_t *arena) {
+   *dst = *src;
+   dst->key_ttype = BLOB_PACK(src->key_ttype, arena);
+   dst->value_ttype = BLOB_PACK(src->value_ttype, arena);
+   dst->fields = BLOB_PACK(src->fields, arena);
+   dst->field_index = BLOB_PACK(src->field_index, arena);
+   dst->field_name = BLOB_PACK(src->field_name, arena);
+   dst->name_ref = LUA_NOREF;
+   dst->stats = NULL;
+}
+
+// Turns the offsets of a node back into pointers, checking that they stay
+// inside their part of the arena. Nodes only point at nodes after them,
+// which rules out cycles. self is the position of the node plus one, 0 for
+// the root.
+static desc_t *thrift_blob_node(void *p, size_t self, size_t count, uint8_t *arena, size_t nodes, int *ret) {
+   if (p == NULL) return NULL;
+   size_t off = (uintptr_t)p - 1;
+   if (off % sizeof(desc_t) || off / sizeof(desc_t) < self || off / sizeof(desc_t) + count > nodes) *ret = -EINVAL;
+   return (desc_t *)(arena + off);
+}
+
+static int thrift_blob_unpack(desc_t *desc, size_t self, uint8_t *arena, size_t nodes, size_t indices, size_t names) {
+   int ret = 0;
+   // both only mean something in the process that wrote the blob
+   desc->name_ref = LUA_NOREF;
+   desc->stats = NULL;
+   desc->key_ttype = thrift_blob_node(desc->key_ttype, self, 1, arena, nodes, &ret);
+   desc->value_ttype = thrift_blob_node(desc->value_ttype, self, 1, arena, nodes, &ret);
+   desc->fields = thrift_blob_node(desc->fields, self, desc->num_fields, arena, nodes, &ret);
+   if (ret) return ret;
+   if (desc->ttype == TTYPE_MAP && (desc->key_ttype == NULL || desc->value_ttype == NULL)) return -EINVAL;
+   if ((desc->ttype == TTYPE_LIST || desc->ttype == TTYPE_SET) && desc->value_ttype == NULL) return -EINVAL;
+   if (desc->num_fields && desc->fields == NULL) return -EINVAL;
+   if (desc->field_index) {
+      size_t off = (uintptr_t)desc->field_index - 1 - nodes * sizeof(desc_t);
+      if (off % sizeof(uint16_t) || off / sizeof(uint16_t) + desc->field_index_size > indices) return -EINVAL;
+      desc->field_index = (uint16_t *)(arena + nodes * sizeof(desc_t) + off);
+      // reads follow the entries without checking them
+      for (uint16_t slot = 0; slot < desc->field_index_size; slot++) {
+         uint16_t i = desc->field_index[slot];
+         if (i == 0) continue;
+         if (i > desc->num_fields || desc->fields[i - 1].field_id != desc->field_index_base + slot) return -EINVAL;
+      }
+   }
+   if (desc->field_name) {
+      size_t off = (uintptr_t)desc->field_name - 1 - nodes * sizeof(desc_t) - indices * sizeof(uint16_t);
+      char *start = (char *)arena + nodes * sizeof(desc_t) + indices * sizeof(uint16_t);
+      if (off >= names || memchr(start + off, 0, names - off) == NULL) return -EINVAL;
+      desc->field_name = start + off;
+   }
+   return 0;
+}
+
+// Checks what parsing a schema would have guaranteed about a node once all
+// nodes are unpacked, readers rely on it as much as on the pointers.
+static int thrift_blob_check(const desc_t *desc) {
+   switch (desc->ttype) {
       case TTYPE_VOID:
-         return 0;
+      case TTYPE_BOOL:
+      case TTYPE_BYTE:
+      case TTYPE_DOUBLE:
+      case TTYPE_I16:
+      case TTYPE_I32:
+      case TTYPE_I64:
+      case TTYPE_STRING:
+      case TTYPE_STRUCT:
+      case TTYPE_MAP:
+      case TTYPE_SET:
+      case TTYPE_LIST:
+         break;
+      default:
+         return -EINVAL;
+   }
+   if (desc->threads > THRIFT_MAX_THREADS) return -EINVAL;
+   if (desc->shape == SHAPE_NONE) return 0;
+   if ((desc->ttype != TTYPE_LIST && desc->ttype != TTYPE_SET) || desc->shape > SHAPE_COLUMNS) return -EINVAL;
+   if (desc->shape == SHAPE_COLUMNS) {
+      const desc_t *item = desc->value_ttype;
+      if (item->ttype != TTYPE_STRUCT) return -EINVAL;
+      for (uint16_t i = 0; i < item->num_fields; i++) {
+         if (!thrift_is_scalar(item->fields[i].ttype)) return -EINVAL;
+      }
+      return 0;
+   }
+   uint8_t levels, ttype;
+   CTRY(thrift_shape_levels(desc, &levels, &ttype))
+   if (levels != desc->shape_levels || ttype != desc->shape_ttype || array_width(ttype) == 0) return -EINVAL;
+   if (desc->shape == SHAPE_RAGGED && levels != 2) return -EINVAL;
+   return 0;
+}
+
+static int thrift_serialize(lua_State *L) {
+   codec_t *codec = (codec_t *)lua_touserdata(L, 1);
+   size_t nodes = 0, indices = 0, names = 0;
+   thrift_desc_measure(&codec->desc, &nodes, &indices, &names);
+   size_t arena_cb = nodes * sizeof(desc_t) + indices * sizeof(uint16_t) + names;
+   size_t cb = sizeof(blob_header_t) + sizeof(desc_t) + arena_cb;
+   uint8_t *blob = (uint8_t *)lua_newuserdata(L, cb);
+   blob_header_t header = { THRIFT_BLOB_MAGIC, THRIFT_BLOB_VERSION, sizeof(desc_t), nodes, indices, names };
+   memcpy(blob, &header, sizeof(header));
+   desc_t node;
+   thrift_blob_pack(&node, &codec->desc, codec->arena);
+   memcpy(blob + sizeof(header), &node, sizeof(desc_t));
+   uint8_t *out = blob + sizeof(header) + sizeof(desc_t);
+   for (size_t i = 0; i < nodes; i++) {
+      thrift_blob_pack(&node, (desc_t *)codec->arena + i, codec->arena);
+      memcpy(out + i * sizeof(desc_t), &node, sizeof(desc_t));
+   }
+   memcpy(out + nodes * sizeof(desc_t), codec->arena + nodes * sizeof(desc_t), arena_cb - nodes * sizeof(desc_t));
+   lua_pushlstring(L, (const char *)blob, cb);
+   return 1;
+}
+
+// Rebuilds a codec from serialize's output with one copy of its arena,
+// without walking a schema table.
+static int thrift_desc_from_blob(lua_State *L) {
+   size_t cb;
+   const uint8_t *blob = (const uint8_t *)luaL_checklstring(L, 1, &cb);
+   blob_header_t header;
+   if (cb < sizeof(header)) return LUA_HANDLE_ERROR_STR(L, "malformed codec blob");
+   memcpy(&header, blob, sizeof(header));
+   if (header.magic != THRIFT_BLOB_MAGIC || header.version != THRIFT_BLOB_VERSION || header.desc_size != sizeof(desc_t)) {
+      return LUA_HANDLE_ERROR_STR(L, "codec blob is from another version of the library");
+   }
+   size_t nodes = header.nodes, indices = header.indices, names = header.names;
+   size_t arena_cb = nodes * sizeof(desc_t) + indices * sizeof(uint16_t) + names;
+   if (cb != sizeof(header) + sizeof(desc_t) + arena_cb) return LUA_HANDLE_ERROR_STR(L, "malformed codec blob");
+   codec_t *codec = (codec_t *)lua_newuserdata(L, sizeof(codec_t));
+   memset(codec, 0, sizeof(codec_t));
+   codec->desc.name_ref = LUA_NOREF;
+   luaL_getmetatable(L, "thrift.codec");
+   lua_setmetatable(L, -2);
+   codec->arena = (uint8_t *)malloc(MAX(arena_cb, 1));
+   if (codec->arena == NULL) return LUA_HANDLE_ERROR(L, ENOMEM);
+   memcpy(codec->arena, blob + sizeof(header) + sizeof(desc_t), arena_cb);
+   desc_t root;
+   memcpy(&root, blob + sizeof(header), sizeof(desc_t));
+   int ret = thrift_blob_unpack(&root, 0, codec->arena, nodes, indices, names);
+   for (size_t i = 0; i < nodes && ret == 0; i++) {
+      ret = thrift_blob_unpack((desc_t *)codec->arena + i, i + 1, codec->arena, nodes, indices, names);
+   }
+   if (ret == 0) ret = thrift_blob_check(&root);
+   for (size_t i = 0; i < nodes && ret == 0; i++) {
+      ret = thrift_blob_check((desc_t *)codec->arena + i);
+   }
+   if (ret) return LUA_HANDLE_ERROR_STR(L, "malformed codec blob");
+   codec->desc = root;
+   thrift_desc_ref_names(L, &codec->desc);
+   if (codec->desc.flags & STATS) TRY(L, thrift_desc_stats(codec))
+   return 1;
+}
+
+// Pushes the key a struct field is stored under in Lua tables.
+static void thrift_push_field_key(lua_State *L, desc_t *field) {
+   if (field->name_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, field->name_ref);
+   } else {
+      lua_pushinteger(L, field->field_id);
+   }
+}
+
+// Pushes the value of a struct field from the table at index.
+static void thrift_get_field(lua_State *L, int index, desc_t *field) {
+   if (field->name_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, field->name_ref);
+      lua_rawget(L, index);
+   } else {
+      lua_rawgeti(L, index, field->field_id);
+   }
+}
+
+static uint64_t thrift_clock_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Counts one value of the given type that took bytes on the wire and
+// started at time t0, against its field too when desc is one.
+static void thrift_stats_value(stats_t *stats, uint8_t ttype, desc_t *desc, size_t bytes, uint64_t t0) {
+   uint64_t ns = thrift_clock_ns() - t0;
+   value_stats_t *v = &stats->ttypes[ttype <= TTYPE_ENUM ? ttype : TTYPE_VOID];
+   v->count++;
+   v->bytes += bytes;
+   v->ns += ns;
+   if (desc && desc >= stats->nodes && desc < stats->nodes + stats->num_nodes) {
+      v = &stats->fields[desc - stats->nodes];
+      v->count++;
+      v->bytes += bytes;
+      v->ns += ns;
+   }
+}
+
+// Counts a whole record read or written by a codec, along with the
+// buffers allocated for it.
+static void thrift_stats_record(desc_t *desc, size_t bytes, int written, int allocations) {
+   stats_t *stats = desc->stats;
+   if (stats == NULL) return;
+   stats->allocations += allocations;
+   if (written) {
+      stats->records_written++;
+      stats->bytes_written += bytes;
+   } else {
+      stats->records_read++;
+      stats->bytes_read += bytes;
+   }
+}
+
+// Pushes a value that is neither a struct nor a container.
+static int thrift_read_scalar(lua_State *L, uint8_t ttype, buffer_t *in, int flags) {
+   switch (ttype) {
       case TTYPE_BOOL: {
-         uint8_t i8;
-         READ(L, &i8, sizeof(i8), in)
-         lua_pushboolean(L, i8 != 0);
+         uint8_t b;
+         TRY(L, proto_read_bool(in, &b))
+         lua_pushboolean(L, b);
          return 1;
       }
       case TTYPE_BYTE: {
          uint8_t i8;
-         READ(L, &i8, sizeof(i8), in)
-         if (out) {
-            memcpy(out, &i8, sizeof(i8));
-            return 0;
-         } else {
-            lua_pushinteger(L, i8);
-            return 1;
-         }
+         TRY(L, proto_read_byte(in, &i8))
+         lua_pushinteger(L, i8);
+         return 1;
       }
       case TTYPE_DOUBLE: {
-         int64_t i64;
-         READ(L, &i64, sizeof(i64), in)
-         i64 = betoh64(i64);
-         if (out) {
-            memcpy(out, &i64, sizeof(i64));
-            return 0;
-         } else {
-            double d;
-            memcpy(&d, &i64, sizeof(i64));
-            lua_pushnumber(L, d);
-            return 1;
-         }
+         double d;
+         TRY(L, proto_read_double(in, &d))
+         lua_pushnumber(L, d);
+         return 1;
       }
       case TTYPE_I16: {
          int16_t i16;
-         READ(L, &i16, sizeof(i16), in)
-         i16 = betoh16(i16);
-         if (out) {
-            memcpy(out, &i16, sizeof(i16));
-            return 0;
-         } else {
-            double d = i16;
-            lua_pushnumber(L, d);
-            return 1;
-         }
+         TRY(L, proto_read_i16(in, &i16))
+         double d = i16;
+         lua_pushnumber(L, d);
+         return 1;
       }
       case TTYPE_I32:
       case TTYPE_ENUM: {
          int32_t i32;
-         READ(L, &i32, sizeof(i32), in)
-         i32 = betoh32(i32);
-         if (out) {
-            memcpy(out, &i32, sizeof(i32));
-            return 0;
-         } else {
-            double d = i32;
-            lua_pushnumber(L, d);
-            return 1;
-         }
+         TRY(L, proto_read_i32(in, &i32))
+         double d = i32;
+         lua_pushnumber(L, d);
+         return 1;
       }
       case TTYPE_I64: {
          int64_t i64;
-         READ(L, &i64, sizeof(i64), in)
-         i64 = betoh64(i64);
-         if (out) {
-            memcpy(out, &i64, sizeof(i64));
-            return 0;
-         }
+         TRY(L, proto_read_i64(in, &i64))
          switch (flags & I64_AS_MASK) {
             case I64_AS_NUMBER: {
                double d = i64;
@@ -316,134 +835,17 @@ static int thrift_read_rcsv(lua_State *L, uint8_t ttype, buffer_t *in, int flags
          }
       }
       case TTYPE_STRING: {
-         int32_t i32;
-         READ(L, &i32, sizeof(i32), in)
-         i32 = betoh32(i32);
-         const char *str = (const char *)(in->data + in->cb);
-         READN(L, (uint32_t)i32, in)
-         lua_pushlstring(L, str, i32);
-         return 1;
-      }
-      case TTYPE_STRUCT: {
-         lua_newtable(L);
-         uint8_t vt;
-         READ(L, &vt, sizeof(vt), in)
-         while (vt != TTYPE_STOP) {
-            uint16_t fid;
-            READ(L, &fid, sizeof(fid), in)
-            fid = betoh16(fid);
-            desc_t *field_desc = NULL;
-            if (desc) {
-               for (uint16_t i = 0; i < desc->num_fields; i++) {
-                  if (desc->fields[i].field_id == fid) {
-                     field_desc = &desc->fields[i];
-                     break;
-                  }
-               }
-               if (field_desc == NULL && desc->num_fields > 0) {
-                  return LUA_HANDLE_ERROR_STR(L, "field id value out of range for struct");
-               }
-            }
-            if (field_desc && field_desc->field_name) {
-               lua_pushstring(L, field_desc->field_name);
-            } else {
-               lua_pushinteger(L, fid);
-            }
-            thrift_read_rcsv(L, vt, in, flags, field_desc, NULL);
-            lua_settable(L, -3);
-            READ(L, &vt, sizeof(vt), in)
-         }
-         return 1;
-      }
-      case TTYPE_MAP: {
-         lua_newtable(L);
-         uint8_t kt;
-         READ(L, &kt, sizeof(kt), in)
-         uint8_t vt;
-         READ(L, &vt, sizeof(vt), in)
-         int32_t i32;
-         READ(L, &i32, sizeof(i32), in)
-         i32 = betoh32(i32);
-         while (i32 > 0) {
-            thrift_read_rcsv(L, kt, in, flags, desc ? desc->key_ttype : NULL, NULL);
-            thrift_read_rcsv(L, vt, in, flags, desc ? desc->value_ttype : NULL, NULL);
-            lua_settable(L, -3);
-            i32--;
-         }
-         return 1;
-      }
-      case TTYPE_SET:
-      case TTYPE_LIST: {
-         uint8_t vt;
-         READ(L, &vt, sizeof(vt), in)
-         int32_t i32;
-         READ(L, &i32, sizeof(i32), in)
-         i32 = betoh32(i32);
-         if (flags & LIST_AND_SET_AS_TENSOR) {
-            switch (vt) {
-               case TTYPE_BYTE: {
-                  THByteStorage *values = THByteStorage_newWithSize(i32);
-                  for (int32_t i = 0; i < i32; i++) {
-                     thrift_read_rcsv(L, vt, in, flags, desc ? desc->value_ttype : NULL, &values->data[i]);
-                  }
-                  THLongStorage *size = THLongStorage_newWithSize(1);
-                  size->data[0] = values->size;
-                  luaT_pushudata(L, THByteTensor_newWithStorage(values, 0, size, NULL), "torch.ByteTensor");
-                  THLongStorage_free(size);
-                  return 1;
-               }
-               case TTYPE_DOUBLE: {
-                  THDoubleStorage *values = THDoubleStorage_newWithSize(i32);
-                  for (int32_t i = 0; i < i32; i++) {
-                     thrift_read_rcsv(L, vt, in, flags, desc ? desc->value_ttype : NULL, &values->data[i]);
-                  }
-                  THLongStorage *size = THLongStorage_newWithSize(1);
-                  size->data[0] = values->size;
-                  luaT_pushudata(L, THDoubleTensor_newWithStorage(values, 0, size, NULL), "torch.DoubleTensor");
-                  THLongStorage_free(size);
-                  return 1;
-               }
-               case TTYPE_I16: {
-                  THShortStorage *values = THShortStorage_newWithSize(i32);
-                  for (int32_t i = 0; i < i32; i++) {
-                     thrift_read_rcsv(L, vt, in, flags, desc ? desc->value_ttype : NULL, &values->data[i]);
-                  }
-                  THLongStorage *size = THLongStorage_newWithSize(1);
-                  size->data[0] = values->size;
-                  luaT_pushudata(L, THShortTensor_newWithStorage(values, 0, size, NULL), "torch.ShortTensor");
-                  THLongStorage_free(size);
-                  return 1;
-               }
-               case TTYPE_I32: {
-                  THIntStorage *values = THIntStorage_newWithSize(i32);
-                  for (int32_t i = 0; i < i32; i++) {
-                     thrift_read_rcsv(L, vt, in, flags, desc ? desc->value_ttype : NULL, &values->data[i]);
-                  }
-                  THLongStorage *size = THLongStorage_newWithSize(1);
-                  size->data[0] = values->size;
-                  luaT_pushudata(L, THIntTensor_newWithStorage(values, 0, size, NULL), "torch.IntTensor");
-                  THLongStorage_free(size);
-                  return 1;
-               }
-               case TTYPE_I64: {
-                  THLongStorage *values = THLongStorage_newWithSize(i32);
-                  for (int32_t i = 0; i < i32; i++) {
-                     thrift_read_rcsv(L, vt, in, flags, desc ? desc->value_ttype : NULL, &values->data[i]);
-                  }
-                  THLongStorage *size = THLongStorage_newWithSize(1);
-                  size->data[0] = values->size;
-                  luaT_pushudata(L, THLongTensor_newWithStorage(values, 0, size, NULL), "torch.LongTensor");
-                  THLongStorage_free(size);
-                  return 1;
-               }
-            }
-         }
-         lua_newtable(L);
-         for (int32_t i = 1; i <= i32; i++) {
-            lua_pushinteger(L, i);
-            thrift_read_rcsv(L, vt, in, flags, desc ? desc->value_ttype : NULL, NULL);
-            lua_settable(L, -3);
+         const uint8_t *str;
+         size_t len;
+         TRY(L, proto_read_binary(in, &str, &len))
+         // strings of tensor inputs can be views that share their storage
+         if ((flags & STRINGS_AS_TENSORS) && in->owner) {
+            THByteStorage *storage = (THByteStorage *)in->owner;
+            THByteTensor *tensor = THByteTensor_newWithStorage1d(storage, str - storage->data, len, 1);
+            luaT_pushudata(L, tensor, "torch.ByteTensor");
+            return 1;
          }
+         lua_pushlstring(L, (const char *)str, len);
          return 1;
       }
       default:
@@ -451,237 +853,2501 @@ static int thrift_read_rcsv(lua_State *L, uint8_t ttype, buffer_t *in, int flags
    }
 }
 
-static int thrift_read(lua_State *L) {
-   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
-   buffer_t in;
-   in.data = (uint8_t *)lua_tolstring(L, 2, &in.max_cb);
-   in.cb = 0;
-   return thrift_read_rcsv(L, desc->ttype, &in, desc->flags, desc, NULL);
-}
-
-static int thrift_read_tensor(lua_State *L) {
-   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
-   THByteTensor *tensor = luaT_toudata(L, 2, "torch.ByteTensor");
+// Pushes a new tensor of a numeric type with the given dimensions and
+// returns its data.
+static void *thrift_push_tensor_nd(lua_State *L, uint8_t ttype, int ndim, const long *dims) {
+   THLongStorage *size = THLongStorage_newWithSize(ndim);
+   memcpy(size->data, dims, ndim * sizeof(long));
+   void *data = NULL;
+   switch (ttype) {
+      case TTYPE_BYTE: {
+         THByteTensor *values = THByteTensor_newWithSize(size, NULL);
+         luaT_pushudata(L, values, "torch.ByteTensor");
+         data = THByteTensor_data(values);
+         break;
+      }
+      case TTYPE_DOUBLE: {
+         THDoubleTensor *values = THDoubleTensor_newWithSize(size, NULL);
+         luaT_pushudata(L, values, "torch.DoubleTensor");
+         data = THDoubleTensor_data(values);
+         break;
+      }
+      case TTYPE_I16: {
+         THShortTensor *values = THShortTensor_newWithSize(size, NULL);
+         luaT_pushudata(L, values, "torch.ShortTensor");
+         data = THShortTensor_data(values);
+         break;
+      }
+      case TTYPE_I32: {
+         THIntTensor *values = THIntTensor_newWithSize(size, NULL);
+         luaT_pushudata(L, values, "torch.IntTensor");
+         data = THIntTensor_data(values);
+         break;
+      }
+      case TTYPE_I64: {
+         THLongTensor *values = THLongTensor_newWithSize(size, NULL);
+         luaT_pushudata(L, values, "torch.LongTensor");
+         data = THLongTensor_data(values);
+         break;
+      }
+   }
+   THLongStorage_free(size);
+   return data;
+}
+
+// Pushes a new 1 dimensional tensor of n values of a numeric type and
+// returns its data.
+static void *thrift_push_tensor(lua_State *L, uint8_t ttype, long n) {
+   return thrift_push_tensor_nd(L, ttype, 1, &n);
+}
+
+// Returns the Lua type name of the tensors of a numeric type.
+static const char *thrift_tensor_name(uint8_t ttype) {
+   switch (ttype) {
+      case TTYPE_BYTE: return "torch.ByteTensor";
+      case TTYPE_DOUBLE: return "torch.DoubleTensor";
+      case TTYPE_I16: return "torch.ShortTensor";
+      case TTYPE_I32: return "torch.IntTensor";
+      case TTYPE_I64: return "torch.LongTensor";
+      default: return NULL;
+   }
+}
+
+#define RESIZE_TENSOR(Real, t, n, data) { \
+   TH##Real##Tensor *tensor = (TH##Real##Tensor *)(t); \
+   if (tensor->nDimension != 1 || tensor->size[0] != (n)) TH##Real##Tensor_resize1d(tensor, n); \
+   *(data) = TH##Real##Tensor_data(tensor); \
+}
+
+// Pushes the tensor at index again to hold n values of a numeric type,
+// resizing it only when its length changes, and sets *data to its values.
+// Returns 0 without pushing anything when the value is not a contiguous 1
+// dimensional tensor of that type.
+static int thrift_reuse_tensor(lua_State *L, int index, uint8_t ttype, long n, void **data) {
+   const char *tname = thrift_tensor_name(ttype);
+   THByteTensor *t = tname ? (THByteTensor *)luaT_toudata(L, index, tname) : NULL;
+   if (t == NULL || t->nDimension > 1 || (t->nDimension == 1 && t->stride[0] != 1)) return 0;
+   switch (ttype) {
+      case TTYPE_BYTE: RESIZE_TENSOR(Byte, t, n, data) break;
+      case TTYPE_DOUBLE: RESIZE_TENSOR(Double, t, n, data) break;
+      case TTYPE_I16: RESIZE_TENSOR(Short, t, n, data) break;
+      case TTYPE_I32: RESIZE_TENSOR(Int, t, n, data) break;
+      case TTYPE_I64: RESIZE_TENSOR(Long, t, n, data) break;
+   }
+   lua_pushvalue(L, index);
+   return 1;
+}
+
+// Pushes a numeric list of i32 elements as a tensor, returns 0 without
+// reading anything when the element type has no tensor representation.
+// A tensor of that type at index reuse, when it is not 0, is filled instead
+// of a new one.
+static int thrift_read_tensor_list(lua_State *L, uint8_t vt, int32_t i32, buffer_t *in, int reuse) {
+   if (array_width(vt) == 0) return 0;
+   // reject sizes the remaining input can not hold before allocating,
+   // the tensor is owned by Lua before it is filled
+   if (proto_min_size(in->protocol, vt, i32) > in->max_cb - in->cb) return LUA_HANDLE_ERROR(L, ENOMEM);
+   void *values;
+   if (!reuse || !thrift_reuse_tensor(L, reuse, vt, i32, &values)) values = thrift_push_tensor(L, vt, i32);
+   TRY(L, proto_read_array(in, vt, values, i32))
+   return 1;
+}
+
+// Sets field name of the table on top of the stack to a tensor of n values
+// of a numeric type and returns its data, keeping the tensor already there
+// when reuse is set and it fits.
+static void *thrift_set_tensor_field(lua_State *L, const char *name, uint8_t ttype, long n, int reuse) {
+   void *data;
+   if (reuse) {
+      lua_getfield(L, -1, name);
+      int reused = thrift_reuse_tensor(L, lua_gettop(L), ttype, n, &data);
+      lua_pop(L, reused ? 2 : 1);
+      if (reused) return data;
+   }
+   data = thrift_push_tensor(L, ttype, n);
+   lua_setfield(L, -2, name);
+   return data;
+}
+
+// Pushes a map of i32 numeric entries as a table of keys and values tensors,
+// returns 0 without reading anything when either type is not numeric. A
+// table at index reuse, when it is not 0, is filled instead of a new one.
+static int thrift_read_tensor_map(lua_State *L, uint8_t kt, uint8_t vt, int32_t i32, buffer_t *in, desc_t *desc, int reuse) {
+   // empty compact maps carry no element types
+   if (i32 == 0 && desc && desc->ttype == TTYPE_MAP) {
+      kt = desc->key_ttype->ttype;
+      vt = desc->value_ttype->ttype;
+   }
+   if (array_width(kt) == 0 || array_width(vt) == 0) return 0;
+   if (proto_min_size(in->protocol, kt, i32) + proto_min_size(in->protocol, vt, i32) > in->max_cb - in->cb) return LUA_HANDLE_ERROR(L, ENOMEM);
+   if (reuse && lua_type(L, reuse) == LUA_TTABLE) {
+      lua_pushvalue(L, reuse);
+   } else {
+      reuse = 0;
+      lua_createtable(L, 0, 2);
+   }
+   void *keys = thrift_set_tensor_field(L, "keys", kt, i32, reuse);
+   void *values = thrift_set_tensor_field(L, "values", vt, i32, reuse);
+   TRY(L, proto_read_pairs(in, kt, keys, vt, values, i32))
+   return 1;
+}
+
+// Nested lists of numbers are read in two passes, the first one skips over
+// them to find and check their shape before anything is allocated. Inner
+// lists of a fixed shape that differ in length fail with -EDOM.
+static int thrift_fixed_shape(buffer_t *in, desc_t *desc, int level, long *dims) {
+   buffer_t header = *in;
+   uint8_t vt;
+   int32_t count;
+   CTRY(proto_read_list_begin(&header, &vt, &count))
+   if (dims[level] < 0) dims[level] = count;
+   else if (dims[level] != count) return -EDOM;
+   if (count && vt != desc->value_ttype->ttype) return -EINVAL;
+   if (array_width(desc->value_ttype->ttype)) return thrift_skip(in, desc->ttype, 0);
+   *in = header;
+   for (int32_t i = 0; i < count; i++) {
+      CTRY(thrift_fixed_shape(in, desc->value_ttype, level + 1, dims))
+   }
+   return 0;
+}
+
+static int thrift_read_fixed(buffer_t *in, desc_t *desc, uint8_t *data, size_t *pos) {
+   uint8_t vt;
+   int32_t count;
+   CTRY(proto_read_list_begin(in, &vt, &count))
+   uint8_t et = desc->value_ttype->ttype;
+   if (array_width(et)) {
+      CTRY(proto_read_array(in, et, data + *pos * array_width(et), count))
+      *pos += count;
+      return 0;
+   }
+   for (int32_t i = 0; i < count; i++) {
+      CTRY(thrift_read_fixed(in, desc->value_ttype, data, pos))
+   }
+   return 0;
+}
+
+static int thrift_read_struct_columns(lua_State *L, desc_t *desc, buffer_t *in, int flags);
+
+// Pushes a nested list of numbers as one tensor of its fixed shape, or as
+// a table of the flat values and the offsets of its ragged rows.
+static int thrift_read_shaped(lua_State *L, desc_t *desc, buffer_t *in, int flags) {
+   if (desc->shape == SHAPE_COLUMNS) return thrift_read_struct_columns(L, desc, in, flags);
+   uint8_t et = desc->shape_ttype;
+   buffer_t scan = *in;
+   if (desc->shape == SHAPE_FIXED) {
+      long dims[THRIFT_MAX_DEPTH];
+      for (int i = 0; i < desc->shape_levels; i++) dims[i] = -1;
+      int ret = thrift_fixed_shape(&scan, desc, 0, dims);
+      if (ret == -EDOM) return LUA_HANDLE_ERROR_STR(L, "inner lists differ in length");
+      TRY(L, ret)
+      if (dims[0] == 0) {
+         thrift_push_tensor(L, et, 0);
+         *in = scan;
+         return 1;
+      }
+      for (int i = 1; i < desc->shape_levels; i++) {
+         if (dims[i] == 0) return LUA_HANDLE_ERROR_STR(L, "empty inner lists have no fixed shape");
+      }
+      uint8_t *values = thrift_push_tensor_nd(L, et, desc->shape_levels, dims);
+      size_t pos = 0;
+      TRY(L, thrift_read_fixed(in, desc, values, &pos))
+      return 1;
+   }
+   uint8_t vt;
+   int32_t n, count;
+   TRY(L, proto_read_list_begin(&scan, &vt, &n))
+   if (n && vt != desc->value_ttype->ttype) return LUA_HANDLE_ERROR(L, EINVAL);
+   if (proto_min_size(in->protocol, vt, n) > scan.max_cb - scan.cb) return LUA_HANDLE_ERROR(L, ENOMEM);
+   lua_createtable(L, 0, 2);
+   long *offsets = thrift_push_tensor(L, TTYPE_I64, n + 1);
+   lua_setfield(L, -2, "offsets");
+   offsets[0] = 0;
+   for (int32_t i = 0; i < n; i++) {
+      buffer_t header = scan;
+      TRY(L, proto_read_list_begin(&header, &vt, &count))
+      if (count && vt != et) return LUA_HANDLE_ERROR(L, EINVAL);
+      TRY(L, thrift_skip(&scan, desc->value_ttype->ttype, 0))
+      offsets[i + 1] = offsets[i] + count;
+   }
+   uint8_t *values = thrift_push_tensor(L, et, offsets[n]);
+   lua_setfield(L, -2, "values");
+   TRY(L, proto_read_list_begin(in, &vt, &n))
+   for (int32_t i = 0; i < n; i++) {
+      TRY(L, proto_read_list_begin(in, &vt, &count))
+      TRY(L, proto_read_array(in, et, values + offsets[i] * array_width(et), count))
+   }
+   return 1;
+}
+
+// A struct or container that is being read, one per nesting level.
+typedef struct read_frame_t {
+   desc_t *desc;
+   int32_t remaining;
+   int32_t index;
+   int16_t last_fid;
+   uint16_t hint;
+   uint8_t ttype;
+   uint8_t key_ttype;
+   uint8_t value_ttype;
+   uint8_t in_value;
+   uint8_t reused;
+   size_t start;
+   uint64_t t0;
+} read_frame_t;
+
+// What readInto needs to overwrite the tables of a previous result.
+typedef struct read_into_t {
+   desc_t *nodes;
+   uint8_t *seen;
+} read_into_t;
+
+// Tables of structs with a schema keep their fields, the fields that were
+// not read are cleared once the struct is done.
+static int thrift_read_into_tracked(read_frame_t *f) {
+   return f->ttype == TTYPE_STRUCT && f->desc && f->desc->ttype == TTYPE_STRUCT && f->desc->num_fields > 0;
+}
+
+// Readies the table on top of the stack to be overwritten by the frame.
+// Maps and structs without a schema can not tell which keys will come, so
+// their tables are cleared up front.
+static void thrift_read_into_begin(lua_State *L, read_frame_t *f, read_into_t *into) {
+   if (thrift_read_into_tracked(f)) {
+      for (uint16_t i = 0; i < f->desc->num_fields; i++) into->seen[&f->desc->fields[i] - into->nodes] = 0;
+      return;
+   }
+   if (f->ttype == TTYPE_LIST || f->ttype == TTYPE_SET) return;
+   lua_pushnil(L);
+   while (lua_next(L, -2)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, -4);
+   }
+}
+
+// Clears what the table on top of the stack kept from before the frame
+// overwrote it, the fields that were not read or the elements past the end.
+static void thrift_read_into_end(lua_State *L, read_frame_t *f, read_into_t *into) {
+   if (thrift_read_into_tracked(f)) {
+      for (uint16_t i = 0; i < f->desc->num_fields; i++) {
+         desc_t *field = &f->desc->fields[i];
+         if (into->seen[field - into->nodes]) continue;
+         thrift_push_field_key(L, field);
+         lua_pushnil(L);
+         lua_rawset(L, -3);
+      }
+   } else if (f->ttype == TTYPE_LIST || f->ttype == TTYPE_SET) {
+      for (int32_t i = f->index + 1; ; i++) {
+         lua_rawgeti(L, -1, i);
+         int stale = !lua_isnil(L, -1);
+         lua_pop(L, 1);
+         if (!stale) break;
+         lua_pushnil(L);
+         lua_rawseti(L, -2, i);
+      }
+   }
+}
+
+// Moves a frame on to its next element. Pushes the key the element is
+// stored under and returns 1 with the element's type, or returns 0 once
+// the frame has no more elements.
+static int thrift_read_next(lua_State *L, read_frame_t *f, buffer_t *in, int flags, uint8_t *ttype, desc_t **desc) {
+   switch (f->ttype) {
+      case TTYPE_STRUCT: {
+         uint8_t vt;
+         uint16_t fid;
+         TRY(L, proto_read_field_begin(in, &vt, &fid, &f->last_fid))
+         while (vt != TTYPE_STOP) {
+            desc_t *field_desc = NULL;
+            if (f->desc) {
+               field_desc = thrift_desc_field(f->desc, fid, &f->hint);
+               if ((flags & PROJECTION) && f->desc->num_fields > 0 && (field_desc == NULL || field_desc->ttype != vt)) {
+                  TRY(L, thrift_skip(in, vt, 0))
+                  TRY(L, proto_read_field_begin(in, &vt, &fid, &f->last_fid))
+                  continue;
+               }
+               if (field_desc == NULL && f->desc->num_fields > 0) {
+                  return LUA_HANDLE_ERROR_STR(L, "field id value out of range for struct");
+               }
+            }
+            if (field_desc) {
+               thrift_push_field_key(L, field_desc);
+            } else {
+               lua_pushinteger(L, fid);
+            }
+            *ttype = vt;
+            *desc = field_desc;
+            return 1;
+         }
+         return 0;
+      }
+      case TTYPE_MAP:
+         if (f->remaining == 0) return 0;
+         f->remaining--;
+         *ttype = f->key_ttype;
+         *desc = f->desc ? f->desc->key_ttype : NULL;
+         return 1;
+      default:
+         if (f->remaining == 0) return 0;
+         f->remaining--;
+         lua_pushinteger(L, ++f->index);
+         *ttype = f->value_ttype;
+         *desc = f->desc ? f->desc->value_ttype : NULL;
+         return 1;
+   }
+}
+
+// Decodes one value and pushes it. Nested structs and containers are kept
+// on an explicit stack of frames instead of the C stack, so hostile nesting
+// fails cleanly past THRIFT_MAX_DEPTH. It is instantiated with and without
+// stats, so codecs that do not count pay nothing for it. With into it
+// overwrites the value on top of the stack instead, reusing its tables and
+// tensors where they fit.
+static inline __attribute__((always_inline))
+int thrift_read_value_impl(lua_State *L, uint8_t ttype, buffer_t *in, int flags, desc_t *desc, const int with_stats, read_into_t *into) {
+   if (ttype == TTYPE_STOP || ttype == TTYPE_VOID) {
+      if (into) lua_pop(L, 1);
+      return 0;
+   }
+   read_frame_t frames[THRIFT_MAX_DEPTH];
+   int depth = 0;
+   stats_t *stats = with_stats && desc ? desc->stats : NULL;
+   while (1) {
+      // start the next value, only structs and containers stay open
+      int done = 1;
+      size_t start = in->cb;
+      uint64_t t0 = stats ? thrift_clock_ns() : 0;
+      // the value being overwritten, map entries are never reused
+      int old = 0;
+      if (into) {
+         if (depth > 0 && frames[depth - 1].ttype != TTYPE_MAP) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+         } else if (depth > 0) {
+            lua_pushnil(L);
+         }
+         old = lua_gettop(L);
+      }
+      switch (ttype) {
+         case TTYPE_STOP:
+         case TTYPE_VOID:
+            lua_pushnil(L);
+            break;
+         case TTYPE_STRUCT:
+         case TTYPE_MAP:
+         case TTYPE_SET:
+         case TTYPE_LIST: {
+            if (depth == THRIFT_MAX_DEPTH) return LUA_HANDLE_ERROR(L, ELOOP);
+            luaL_checkstack(L, 4, "thrift value nested too deeply");
+            read_frame_t *f = &frames[depth];
+            memset(f, 0, sizeof(read_frame_t));
+            f->desc = desc;
+            f->ttype = ttype;
+            f->start = start;
+            f->t0 = t0;
+            if (ttype == TTYPE_MAP) {
+               TRY(L, proto_read_map_begin(in, &f->key_ttype, &f->value_ttype, &f->remaining))
+               if ((flags & MAP_AS_TENSORS) && thrift_read_tensor_map(L, f->key_ttype, f->value_ttype, f->remaining, in, desc, old)) break;
+            } else if (desc && desc->shape && desc->ttype == ttype) {
+               thrift_read_shaped(L, desc, in, flags);
+               break;
+            } else if (ttype != TTYPE_STRUCT) {
+               TRY(L, proto_read_list_begin(in, &f->value_ttype, &f->remaining))
+               if ((flags & LIST_AND_SET_AS_TENSOR) && thrift_read_tensor_list(L, f->value_ttype, f->remaining, in, old)) break;
+            }
+            // every element takes at least a byte, which bounds hostile counts
+            int size = MIN(f->remaining, (int32_t)MIN(in->max_cb - in->cb, INT32_MAX));
+            if (old && lua_type(L, old) == LUA_TTABLE) {
+               f->reused = 1;
+               thrift_read_into_begin(L, f, into);
+            } else if (ttype == TTYPE_STRUCT) {
+               if (desc && desc->ttype == TTYPE_STRUCT) lua_createtable(L, desc->table_narr, desc->table_nrec);
+               else lua_newtable(L);
+            } else if (ttype == TTYPE_MAP) {
+               lua_createtable(L, 0, size);
+            } else {
+               lua_createtable(L, size, 0);
+            }
+            depth++;
+            done = 0;
+            break;
+         }
+         default: {
+            // map keys stay strings, views would only compare by identity
+            int key = depth > 0 && frames[depth - 1].ttype == TTYPE_MAP && !frames[depth - 1].in_value;
+            void *i64;
+            if (old && ttype == TTYPE_I64 && (flags & I64_AS_MASK) == I64_AS_TENSOR && thrift_reuse_tensor(L, old, TTYPE_I64, 1, &i64)) {
+               TRY(L, proto_read_i64(in, (int64_t *)i64))
+               break;
+            }
+            thrift_read_scalar(L, ttype, in, key ? flags & ~STRINGS_AS_TENSORS : flags);
+            break;
+         }
+      }
+      // new values are pushed above the old one, reused ones replace it
+      int reused = old && lua_rawequal(L, old, -1);
+      if (old && lua_gettop(L) > old) lua_remove(L, old);
+      if (stats && done) {
+         thrift_stats_value(stats, ttype, desc, in->cb - start, t0);
+         if (ttype >= TTYPE_STRING && ttype <= TTYPE_LIST && !reused) stats->allocations++;
+      }
+      // hand finished values to their parents until one wants another value
+      while (1) {
+         if (done) {
+            if (depth == 0) return 1;
+            read_frame_t *f = &frames[depth - 1];
+            if (f->ttype == TTYPE_MAP && !f->in_value) {
+               f->in_value = 1;
+               ttype = f->value_ttype;
+               desc = f->desc ? f->desc->value_ttype : NULL;
+               break;
+            }
+            f->in_value = 0;
+            lua_settable(L, -3);
+         }
+         if (thrift_read_next(L, &frames[depth - 1], in, flags, &ttype, &desc)) {
+            read_frame_t *f = &frames[depth - 1];
+            if (into && f->reused && desc && thrift_read_into_tracked(f)) into->seen[desc - into->nodes] = 1;
+            break;
+         }
+         depth--;
+         done = 1;
+         read_frame_t *f = &frames[depth];
+         if (into && f->reused) thrift_read_into_end(L, f, into);
+         if (stats) {
+            thrift_stats_value(stats, f->ttype, f->desc, in->cb - f->start, f->t0);
+            if (!f->reused) stats->allocations++;
+         }
+      }
+   }
+}
+
+static int thrift_read_value(lua_State *L, uint8_t ttype, buffer_t *in, int flags, desc_t *desc) {
+   if (flags & STATS) return thrift_read_value_impl(L, ttype, in, flags, desc, 1, NULL);
+   return thrift_read_value_impl(L, ttype, in, flags, desc, 0, NULL);
+}
+
+static int thrift_read_value_into(lua_State *L, uint8_t ttype, buffer_t *in, int flags, desc_t *desc, read_into_t *into) {
+   if (flags & STATS) return thrift_read_value_impl(L, ttype, in, flags, desc, 1, into);
+   return thrift_read_value_impl(L, ttype, in, flags, desc, 0, into);
+}
+
+static int thrift_read(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   memset(&in, 0, sizeof(buffer_t));
+   in.data = (uint8_t *)lua_tolstring(L, 2, &in.max_cb);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   int ret = thrift_read_value(L, desc->ttype, &in, desc->flags, desc);
+   thrift_stats_record(desc, in.cb, 0, 0);
+   return ret;
+}
+
+static int thrift_tensor_buffer(lua_State *L, int index, buffer_t *in) {
+   THByteTensor *tensor = luaT_checkudata(L, index, "torch.ByteTensor");
+   memset(in, 0, sizeof(buffer_t));
+   if (tensor->nDimension == 0) return 0;
+   if (tensor->nDimension != 1 || tensor->stride[0] != 1) return LUA_HANDLE_ERROR_STR(L, "expected a contiguous 1 dimensional tensor");
+   in->data = (uint8_t *)(tensor->storage->data + tensor->storageOffset);
+   in->max_cb = tensor->size[0];
+   in->owner = tensor->storage;
+   return 0;
+}
+
+// Reads from either a string or a ByteTensor, returns 1 for a string.
+static int thrift_source_buffer(lua_State *L, int index, buffer_t *in) {
+   if (lua_type(L, index) == LUA_TSTRING) {
+      memset(in, 0, sizeof(buffer_t));
+      in->data = (uint8_t *)lua_tolstring(L, index, &in->max_cb);
+      return 1;
+   }
+   thrift_tensor_buffer(L, index, in);
+   return 0;
+}
+
+static int thrift_read_tensor(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   thrift_tensor_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   int ret = thrift_read_value(L, desc->ttype, &in, desc->flags, desc);
+   thrift_stats_record(desc, in.cb, 0, 0);
+   return ret;
+}
+
+// Decodes over the result of an earlier read, overwriting its tables in
+// place and refilling its tensors, so steady state decoding allocates next
+// to nothing. Returns the target, or a new value when it is not a table.
+static int thrift_read_into(lua_State *L) {
+   codec_t *codec = (codec_t *)lua_touserdata(L, 1);
+   desc_t *desc = &codec->desc;
    buffer_t in;
-   in.data = (uint8_t *)(tensor->storage->data + tensor->storageOffset);
-   in.max_cb = tensor->size[0];
-   in.cb = 0;
-   return thrift_read_rcsv(L, desc->ttype, &in, desc->flags, desc, NULL);
+   thrift_source_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   if (codec->seen == NULL) {
+      size_t nodes = 0, indices = 0, names = 0;
+      thrift_desc_measure(desc, &nodes, &indices, &names);
+      codec->seen = (uint8_t *)malloc(MAX(nodes, 1));
+      if (codec->seen == NULL) return LUA_HANDLE_ERROR(L, ENOMEM);
+   }
+   read_into_t into = { (desc_t *)codec->arena, codec->seen };
+   lua_settop(L, 3);
+   int ret = thrift_read_value_into(L, desc->ttype, &in, desc->flags, desc, &into);
+   thrift_stats_record(desc, in.cb, 0, 0);
+   return ret;
+}
+
+// Narrows record to the next record in the stream. Framed streams prefix
+// every record with its big-endian i32 length and the record is bounded
+// by it; unframed records run until the decoder stops.
+static int thrift_frame_begin(buffer_t *in, int framed, buffer_t *record) {
+   *record = *in;
+   if (framed) {
+      int32_t i32;
+      CREAD(&i32, sizeof(i32), record)
+      i32 = betoh32(i32);
+      if (i32 < 0 || (size_t)i32 > record->max_cb - record->cb) return -ERANGE;
+      record->max_cb = record->cb + i32;
+   }
+   return 0;
+}
+
+static void thrift_frame_end(buffer_t *in, int framed, buffer_t *record) {
+   in->cb = framed ? record->max_cb : record->cb;
+}
+
+// Decodes back to back records, each optionally preceded by a big-endian
+// i32 frame length, into an array. Stops after n records or at the end of
+// the tensor and also returns the offset one past the last record read.
+static int thrift_read_batch(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   thrift_tensor_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   lua_Integer n = luaL_optinteger(L, 3, -1);
+   int framed = lua_toboolean(L, 4);
+   lua_newtable(L);
+   int results = lua_gettop(L);
+   lua_Integer count = 0;
+   while (in.cb < in.max_cb && (n < 0 || count < n)) {
+      buffer_t record;
+      int ret = thrift_frame_begin(&in, framed, &record);
+      if (ret) return LUA_HANDLE_ERROR(L, ret);
+      if (thrift_read_value(L, desc->ttype, &record, desc->flags, desc) == 0) lua_pushnil(L);
+      thrift_stats_record(desc, record.cb - in.cb, 0, 0);
+      thrift_frame_end(&in, framed, &record);
+      lua_rawseti(L, results, ++count);
+   }
+   lua_pushinteger(L, in.cb);
+   return 2;
+}
+
+// Finds where back to back records start by skipping over them with their
+// type tags alone. Returns a LongTensor of the offsets of the records and
+// the offset one past the last one, taking the same optional count and
+// framed arguments as readBatch.
+static int thrift_index(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   thrift_tensor_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   lua_Integer n = luaL_optinteger(L, 3, -1);
+   int framed = lua_toboolean(L, 4);
+   THLongTensor *offsets = THLongTensor_newWithSize1d(64);
+   luaT_pushudata(L, offsets, "torch.LongTensor");
+   long count = 0;
+   while (in.cb < in.max_cb && (n < 0 || count < n)) {
+      buffer_t record;
+      int ret = thrift_frame_begin(&in, framed, &record);
+      if (ret == 0 && !framed) ret = thrift_skip(&record, desc->ttype, 0);
+      if (ret) return LUA_HANDLE_ERROR(L, ret);
+      if (count == THLongTensor_size(offsets, 0)) THLongTensor_resize1d(offsets, 2 * count);
+      THLongTensor_data(offsets)[count++] = in.cb;
+      thrift_frame_end(&in, framed, &record);
+   }
+   THLongTensor_resize1d(offsets, count);
+   lua_pushinteger(L, in.cb);
+   return 2;
+}
+
+// Checks that a string or ByteTensor starts with one well formed value of
+// the codec's type that stays within bounds. Returns its size, or nil and
+// the reason when it is not.
+static int thrift_validate(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   thrift_source_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   int ret = thrift_skip(&in, desc->ttype, 0);
+   if (ret) {
+      lua_pushnil(L);
+      lua_pushstring(L, strerror(ret < 0 ? -ret : ret));
+      return 2;
+   }
+   lua_pushinteger(L, in.cb);
+   return 1;
+}
+
+#define TENSOR_BYTE   (0)
+#define TENSOR_CHAR   (1)
+#define TENSOR_SHORT  (2)
+#define TENSOR_INT    (3)
+#define TENSOR_LONG   (4)
+#define TENSOR_FLOAT  (5)
+#define TENSOR_DOUBLE (6)
+
+// A typeless view of the elements of a 1 dimensional tensor of any type.
+typedef struct tensor_view_t {
+   uint8_t *data;
+   long size;
+   ptrdiff_t stride;
+   int kind;
+} tensor_view_t;
+
+#define TENSOR_VIEW(Real, tensor_kind) { \
+      TH##Real##Tensor *t = luaT_toudata(L, index, "torch." #Real "Tensor"); \
+      if (t) { \
+         if (t->nDimension == 0) { \
+            memset(view, 0, sizeof(tensor_view_t)); \
+            view->kind = tensor_kind; \
+            return 0; \
+         } \
+         if (t->nDimension != 1) return LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional tensor"); \
+         view->data = (uint8_t *)(t->storage->data + t->storageOffset); \
+         view->size = t->size[0]; \
+         view->stride = t->stride[0] * sizeof(*t->storage->data); \
+         view->kind = tensor_kind; \
+         return 0; \
+      } \
+   }
+
+static int thrift_tensor_view(lua_State *L, int index, tensor_view_t *view) {
+   TENSOR_VIEW(Byte, TENSOR_BYTE)
+   TENSOR_VIEW(Char, TENSOR_CHAR)
+   TENSOR_VIEW(Short, TENSOR_SHORT)
+   TENSOR_VIEW(Int, TENSOR_INT)
+   TENSOR_VIEW(Long, TENSOR_LONG)
+   TENSOR_VIEW(Float, TENSOR_FLOAT)
+   TENSOR_VIEW(Double, TENSOR_DOUBLE)
+   return LUA_HANDLE_ERROR_STR(L, "expected a tensor");
+}
+
+static void thrift_tensor_view_set(tensor_view_t *view, long i, int64_t i64, double d, int is_double) {
+   uint8_t *p = view->data + i * view->stride;
+   switch (view->kind) {
+      case TENSOR_BYTE: *(uint8_t *)p = is_double ? (uint8_t)d : (uint8_t)i64; return;
+      case TENSOR_CHAR: *(int8_t *)p = is_double ? (int8_t)d : (int8_t)i64; return;
+      case TENSOR_SHORT: *(int16_t *)p = is_double ? (int16_t)d : (int16_t)i64; return;
+      case TENSOR_INT: *(int32_t *)p = is_double ? (int32_t)d : (int32_t)i64; return;
+      case TENSOR_LONG: *(long *)p = is_double ? (long)d : (long)i64; return;
+      case TENSOR_FLOAT: *(float *)p = is_double ? (float)d : (float)i64; return;
+      case TENSOR_DOUBLE: *(double *)p = is_double ? d : (double)i64; return;
+   }
+}
+
+static int thrift_tensor_view_get(const tensor_view_t *view, long i, int64_t *i64, double *d) {
+   const uint8_t *p = view->data + i * view->stride;
+   switch (view->kind) {
+      case TENSOR_BYTE: *i64 = *(const uint8_t *)p; return 0;
+      case TENSOR_CHAR: *i64 = *(const int8_t *)p; return 0;
+      case TENSOR_SHORT: *i64 = *(const int16_t *)p; return 0;
+      case TENSOR_INT: *i64 = *(const int32_t *)p; return 0;
+      case TENSOR_LONG: *i64 = *(const long *)p; return 0;
+      case TENSOR_FLOAT: *d = *(const float *)p; return 1;
+      default: *d = *(const double *)p; return 1;
+   }
+}
+
+// Lists of structs of scalars read as a table of values, with a tensor per
+// field, and of presence masks, with a ByteTensor per field that is 1 for
+// the items that had the field. Missing values are 0. Bools read as bytes
+// and enums as i32.
+static uint8_t thrift_column_ttype(uint8_t ttype, int *kind) {
+   switch (ttype) {
+      case TTYPE_BOOL:
+      case TTYPE_BYTE: *kind = TENSOR_BYTE; return TTYPE_BYTE;
+      case TTYPE_I16: *kind = TENSOR_SHORT; return TTYPE_I16;
+      case TTYPE_I32:
+      case TTYPE_ENUM: *kind = TENSOR_INT; return TTYPE_I32;
+      case TTYPE_I64: *kind = TENSOR_LONG; return TTYPE_I64;
+      default: *kind = TENSOR_DOUBLE; return TTYPE_DOUBLE;
+   }
+}
+
+static void thrift_push_column(lua_State *L, uint8_t ttype, long n, tensor_view_t *view) {
+   uint8_t tt = thrift_column_ttype(ttype, &view->kind);
+   view->data = (uint8_t *)thrift_push_tensor(L, tt, n);
+   view->size = n;
+   view->stride = array_width(tt);
+   if (n) memset(view->data, 0, n * view->stride);
+}
+
+static int thrift_read_struct_columns(lua_State *L, desc_t *desc, buffer_t *in, int flags) {
+   desc_t *item = desc->value_ttype;
+   uint8_t vt;
+   int32_t n;
+   TRY(L, proto_read_list_begin(in, &vt, &n))
+   if (n && vt != TTYPE_STRUCT) return LUA_HANDLE_ERROR(L, EINVAL);
+   // every struct takes at least its stop byte
+   if ((size_t)n > in->max_cb - in->cb) return LUA_HANDLE_ERROR(L, ENOMEM);
+   tensor_view_t *values = (tensor_view_t *)lua_newuserdata(L, MAX(2 * item->num_fields * sizeof(tensor_view_t), 1));
+   tensor_view_t *masks = values + item->num_fields;
+   int scratch = lua_gettop(L);
+   lua_createtable(L, 0, 2);
+   lua_createtable(L, 0, item->num_fields);
+   lua_createtable(L, 0, item->num_fields);
+   for (uint16_t j = 0; j < item->num_fields; j++) {
+      thrift_push_field_key(L, &item->fields[j]);
+      thrift_push_column(L, item->fields[j].ttype, n, &values[j]);
+      lua_rawset(L, scratch + 2);
+      thrift_push_field_key(L, &item->fields[j]);
+      thrift_push_column(L, TTYPE_BYTE, n, &masks[j]);
+      lua_rawset(L, scratch + 3);
+   }
+   lua_setfield(L, scratch + 1, "present");
+   lua_setfield(L, scratch + 1, "values");
+   for (int32_t i = 0; i < n; i++) {
+      int16_t last_fid = 0;
+      uint16_t hint = 0;
+      uint16_t fid;
+      TRY(L, proto_read_field_begin(in, &vt, &fid, &last_fid))
+      while (vt != TTYPE_STOP) {
+         desc_t *field = thrift_desc_field(item, fid, &hint);
+         if (field && field->ttype == vt) {
+            int64_t i64 = 0;
+            double d = 0;
+            int is_double = proto_read_scalar(in, vt, &i64, &d);
+            if (is_double < 0) return LUA_HANDLE_ERROR(L, is_double);
+            thrift_tensor_view_set(&values[field - item->fields], i, i64, d, is_double);
+            thrift_tensor_view_set(&masks[field - item->fields], i, 1, 0, 0);
+         } else if (flags & PROJECTION) {
+            TRY(L, thrift_skip(in, vt, 0))
+         } else {
+            return LUA_HANDLE_ERROR_STR(L, "field id value out of range for struct");
+         }
+         TRY(L, proto_read_field_begin(in, &vt, &fid, &last_fid))
+      }
+   }
+   lua_remove(L, scratch);
+   return 1;
+}
+
+// Finds the field tensors and masks a list of structs is written from as
+// columns. Returns the number of items with a userdata of their views
+// pushed, or -1 with nothing pushed when the list is a plain table. Fields
+// without a tensor are absent from every item, fields without a mask are
+// present in every item.
+static long thrift_struct_columns_views(lua_State *L, int index, desc_t *desc, tensor_view_t **views) {
+   desc_t *item = desc->value_ttype;
+   lua_getfield(L, index, "values");
+   if (lua_type(L, -1) != LUA_TTABLE) {
+      lua_pop(L, 1);
+      return -1;
+   }
+   lua_getfield(L, index, "present");
+   int top = lua_gettop(L);
+   *views = (tensor_view_t *)lua_newuserdata(L, MAX(2 * item->num_fields * sizeof(tensor_view_t), 1));
+   memset(*views, 0, 2 * item->num_fields * sizeof(tensor_view_t));
+   tensor_view_t *masks = *views + item->num_fields;
+   long n = -1;
+   for (uint16_t j = 0; j < item->num_fields; j++) {
+      thrift_get_field(L, top - 1, &item->fields[j]);
+      if (!lua_isnil(L, -1)) {
+         thrift_tensor_view(L, lua_gettop(L), &(*views)[j]);
+         if (n >= 0 && (*views)[j].size != n) return LUA_HANDLE_ERROR_STR(L, "columns differ in size");
+         n = (*views)[j].size;
+      }
+      lua_pop(L, 1);
+      if (lua_type(L, top) != LUA_TTABLE) continue;
+      thrift_get_field(L, top, &item->fields[j]);
+      if (!lua_isnil(L, -1)) {
+         thrift_tensor_view(L, lua_gettop(L), &masks[j]);
+         if (masks[j].kind != TENSOR_BYTE) return LUA_HANDLE_ERROR_STR(L, "masks must be ByteTensors");
+         if (masks[j].size != (*views)[j].size) return LUA_HANDLE_ERROR_STR(L, "masks differ in size from their columns");
+      }
+      lua_pop(L, 1);
+   }
+   lua_replace(L, top - 1);
+   lua_pop(L, 1);
+   return MAX(n, 0);
+}
+
+// Returns 1 with the value of field j of item i when the item has it, 0
+// when it does not, or -ERANGE when the value does not fit the field.
+// Floating point values of integer fields have to be whole numbers, like
+// they do when writing tables.
+static int thrift_struct_column_get(const tensor_view_t *views, desc_t *item, uint16_t j, long i, int64_t *i64, double *d) {
+   const tensor_view_t *mask = &views[item->num_fields + j];
+   if (views[j].data == NULL) return 0;
+   if (mask->data && mask->data[i * mask->stride] == 0) return 0;
+   uint8_t ttype = item->fields[j].ttype;
+   if (thrift_tensor_view_get(&views[j], i, i64, d)) {
+      *i64 = 0;
+      if (ttype == TTYPE_DOUBLE) return 1;
+      // NaN fails both comparisons, 2^63 itself does not fit
+      if (!(*d >= -9223372036854775808.0 && *d < 9223372036854775808.0)) return -ERANGE;
+      *i64 = (int64_t)*d;
+      if ((double)*i64 != *d) return -ERANGE;
+   } else {
+      *d = (double)*i64;
+   }
+   switch (ttype) {
+      case TTYPE_BOOL: return *i64 == 0 || *i64 == 1 ? 1 : -ERANGE;
+      case TTYPE_BYTE: return *i64 == (uint8_t)*i64 ? 1 : -ERANGE;
+      case TTYPE_I16: return *i64 == (int16_t)*i64 ? 1 : -ERANGE;
+      case TTYPE_I32:
+      case TTYPE_ENUM: return *i64 == (int32_t)*i64 ? 1 : -ERANGE;
+      default: return 1;
+   }
+}
+
+static size_t thrift_size_struct_columns(uint8_t protocol, desc_t *desc, const tensor_view_t *views, long n) {
+   desc_t *item = desc->value_ttype;
+   size_t size = proto_size_list_begin(protocol, n) + n * sizeof(uint8_t);
+   for (long i = 0; i < n; i++) {
+      int16_t last_fid = 0;
+      for (uint16_t j = 0; j < item->num_fields; j++) {
+         int64_t i64;
+         double d;
+         if (thrift_struct_column_get(views, item, j, i, &i64, &d) <= 0) continue;
+         size += proto_size_field_begin(protocol, item->fields[j].field_id, &last_fid);
+         // compact bool fields carry their value in the field header
+         if (protocol == PROTOCOL_BINARY || item->fields[j].ttype != TTYPE_BOOL) {
+            size += proto_size_scalar(protocol, item->fields[j].ttype, i64);
+         }
+      }
+   }
+   return size;
+}
+
+static int thrift_write_struct_columns(buffer_t *out, desc_t *desc, const tensor_view_t *views, long n) {
+   desc_t *item = desc->value_ttype;
+   CTRY(proto_write_list_begin(out, TTYPE_STRUCT, n))
+   for (long i = 0; i < n; i++) {
+      int16_t last_fid = 0;
+      for (uint16_t j = 0; j < item->num_fields; j++) {
+         int64_t i64;
+         double d;
+         int ret = thrift_struct_column_get(views, item, j, i, &i64, &d);
+         if (ret < 0) return ret;
+         if (ret == 0) continue;
+         desc_t *field = &item->fields[j];
+         CTRY(proto_write_field_begin(out, field->ttype, field->field_id, &last_fid, i64 != 0))
+         switch (field->ttype) {
+            case TTYPE_BOOL: CTRY(proto_write_bool(out, i64 != 0)) break;
+            case TTYPE_BYTE: CTRY(proto_write_byte(out, (uint8_t)i64)) break;
+            case TTYPE_I16: CTRY(proto_write_i16(out, (int16_t)i64)) break;
+            case TTYPE_I32:
+            case TTYPE_ENUM: CTRY(proto_write_i32(out, (int32_t)i64)) break;
+            case TTYPE_I64: CTRY(proto_write_i64(out, i64)) break;
+            default: CTRY(proto_write_double(out, d)) break;
+         }
+      }
+      CTRY(proto_write_field_stop(out))
+   }
+   return 0;
+}
+
+// Column decode walks a trie of the requested field paths. Interior nodes
+// are structs, leaves are scalar fields that land in one tensor row per
+// record. Everything not on a path is skipped without being decoded.
+typedef struct column_node_t {
+   uint16_t field_id;
+   uint8_t ttype;
+   int column;
+   int first_child;
+   int next_sibling;
+} column_node_t;
+
+typedef struct columns_t {
+   tensor_view_t *values;
+   tensor_view_t *masks;
+   uint8_t *seen;
+   int num_columns;
+   column_node_t *nodes;
+   int num_nodes;
+} columns_t;
+
+static int thrift_read_columns_rcsv(buffer_t *in, columns_t *cols, int node, long row, int depth) {
+   if (depth > THRIFT_MAX_DEPTH) return -ELOOP;
+   int16_t last_fid = 0;
+   uint8_t vt;
+   uint16_t fid;
+   CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid))
+   while (vt != TTYPE_STOP) {
+      int child = cols->nodes[node].first_child;
+      while (child >= 0 && cols->nodes[child].field_id != fid) {
+         child = cols->nodes[child].next_sibling;
+      }
+      int ret;
+      if (child < 0) {
+         ret = thrift_skip(in, vt, depth + 1);
+      } else if (cols->nodes[child].ttype != vt) {
+         ret = -EINVAL;
+      } else if (cols->nodes[child].column >= 0) {
+         int c = cols->nodes[child].column;
+         int64_t i64 = 0;
+         double d = 0;
+         ret = proto_read_scalar(in, vt, &i64, &d);
+         if (ret >= 0) {
+            thrift_tensor_view_set(&cols->values[c], row, i64, d, ret);
+            cols->seen[c] = 1;
+            ret = 0;
+         }
+      } else {
+         ret = thrift_read_columns_rcsv(in, cols, child, row, depth + 1);
+      }
+      if (ret) return ret;
+      CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid))
+   }
+   return 0;
+}
+
+static int thrift_read_columns_row(buffer_t *in, columns_t *cols, long row) {
+   memset(cols->seen, 0, cols->num_columns);
+   int ret = thrift_read_columns_rcsv(in, cols, 0, row, 0);
+   for (int c = 0; c < cols->num_columns; c++) {
+      if (!cols->seen[c]) thrift_tensor_view_set(&cols->values[c], row, 0, 0, 0);
+      if (cols->masks[c].data) thrift_tensor_view_set(&cols->masks[c], row, cols->seen[c], 0, 0);
+   }
+   return ret;
+}
+
+// Adds the dotted field path at the top of the stack to the trie. Path
+// components are field names or numeric field ids.
+static int thrift_columns_add(lua_State *L, desc_t *desc, columns_t *cols, int column) {
+   const char *path = lua_tostring(L, -1);
+   if (path == NULL) return LUA_HANDLE_ERROR_STR(L, "expected a field path");
+   int node = 0;
+   while (*path) {
+      const char *end = strchr(path, '.');
+      size_t len = end ? (size_t)(end - path) : strlen(path);
+      if (desc->ttype != TTYPE_STRUCT) return LUA_HANDLE_ERROR_STR(L, "field path goes through a non struct field");
+      desc_t *field = thrift_desc_find(desc, path, len);
+      if (field == NULL) return LUA_HANDLE_ERROR_STR(L, "field path not found in schema");
+      int child = cols->nodes[node].first_child;
+      while (child >= 0 && cols->nodes[child].field_id != field->field_id) {
+         child = cols->nodes[child].next_sibling;
+      }
+      if (child < 0) {
+         child = cols->num_nodes++;
+         cols->nodes[child].field_id = field->field_id;
+         cols->nodes[child].ttype = field->ttype;
+         cols->nodes[child].column = -1;
+         cols->nodes[child].first_child = -1;
+         cols->nodes[child].next_sibling = cols->nodes[node].first_child;
+         cols->nodes[node].first_child = child;
+      }
+      node = child;
+      desc = field;
+      path += end ? len + 1 : len;
+   }
+   if (node == 0 || cols->nodes[node].column >= 0 || cols->nodes[node].first_child >= 0) {
+      return LUA_HANDLE_ERROR_STR(L, "field path is empty or used twice");
+   }
+   if (!thrift_is_scalar(desc->ttype)) return LUA_HANDLE_ERROR_STR(L, "columns must be scalar fields");
+   cols->nodes[node].column = column;
+   return 0;
+}
+
+// Threaded column decodes first find where every record starts, then let
+// each worker decode a contiguous range of rows into the shared tensors.
+// Rows are disjoint, so workers never write to the same element.
+#define COLUMNS_MIN_ROWS_PER_THREAD (256)
+
+typedef struct columns_job_t {
+   buffer_t in;
+   const size_t *offsets;
+   columns_t cols;
+   long first;
+   long last;
+   int framed;
+   int ret;
+} columns_job_t;
+
+static void *thrift_read_columns_job(void *arg) {
+   columns_job_t *job = (columns_job_t *)arg;
+   for (long row = job->first; row < job->last && job->ret == 0; row++) {
+      buffer_t in = job->in;
+      buffer_t record;
+      in.cb = job->offsets[row];
+      in.max_cb = job->offsets[row + 1];
+      job->ret = thrift_frame_begin(&in, job->framed, &record);
+      if (job->ret == 0) job->ret = thrift_read_columns_row(&record, &job->cols, row);
+   }
+   return NULL;
+}
+
+// Finds the start of up to rows records, offsets ends up holding one more
+// entry than the returned count, the end of the last record.
+static int thrift_columns_offsets(buffer_t *in, int framed, long rows, size_t **offsets, long *count) {
+   size_t max_offsets = 0;
+   *offsets = NULL;
+   *count = 0;
+   while (1) {
+      if ((size_t)*count == max_offsets) {
+         max_offsets = MAX(max_offsets * 2, 1024);
+         size_t *grown = (size_t *)realloc(*offsets, max_offsets * sizeof(size_t));
+         if (grown == NULL) return -ENOMEM;
+         *offsets = grown;
+      }
+      (*offsets)[*count] = in->cb;
+      if (*count == rows || in->cb >= in->max_cb) return 0;
+      buffer_t record;
+      CTRY(thrift_frame_begin(in, framed, &record))
+      if (!framed) CTRY(thrift_skip(&record, TTYPE_STRUCT, 0))
+      thrift_frame_end(in, framed, &record);
+      (*count)++;
+   }
+}
+
+static int thrift_read_columns_threads(lua_State *L, buffer_t *in, columns_t *cols, long rows, int framed, int threads) {
+   size_t *offsets;
+   long count;
+   int ret = thrift_columns_offsets(in, framed, rows, &offsets, &count);
+   if (ret) {
+      free(offsets);
+      return LUA_HANDLE_ERROR(L, ret);
+   }
+   long per_thread = MAX((count + threads - 1) / threads, COLUMNS_MIN_ROWS_PER_THREAD);
+   int num_jobs = (int)MAX((count + per_thread - 1) / per_thread, 1);
+   columns_job_t *jobs = (columns_job_t *)calloc(num_jobs, sizeof(columns_job_t) + cols->num_columns);
+   pthread_t *workers = (pthread_t *)calloc(num_jobs, sizeof(pthread_t));
+   uint8_t *started = (uint8_t *)calloc(num_jobs, 1);
+   if (jobs == NULL || workers == NULL || started == NULL) {
+      ret = -ENOMEM;
+   } else {
+      uint8_t *seen = (uint8_t *)(jobs + num_jobs);
+      for (int j = 0; j < num_jobs; j++) {
+         jobs[j].in = *in;
+         jobs[j].offsets = offsets;
+         jobs[j].cols = *cols;
+         jobs[j].cols.seen = seen + j * cols->num_columns;
+         jobs[j].first = j * per_thread;
+         jobs[j].last = (j + 1) * per_thread < count ? (j + 1) * per_thread : count;
+         jobs[j].framed = framed;
+      }
+      // the calling thread takes the first range, a worker that fails to
+      // start has its range decoded here as well
+      for (int j = 1; j < num_jobs; j++) {
+         started[j] = pthread_create(&workers[j], NULL, thrift_read_columns_job, &jobs[j]) == 0;
+      }
+      thrift_read_columns_job(&jobs[0]);
+      for (int j = 1; j < num_jobs; j++) {
+         if (started[j]) pthread_join(workers[j], NULL);
+         else thrift_read_columns_job(&jobs[j]);
+      }
+      for (int j = 0; j < num_jobs && ret == 0; j++) {
+         ret = jobs[j].ret;
+      }
+      in->cb = offsets[count];
+   }
+   free(offsets);
+   free(jobs);
+   free(workers);
+   free(started);
+   if (ret) return LUA_HANDLE_ERROR(L, ret);
+   lua_pushinteger(L, count);
+   lua_pushinteger(L, in->cb);
+   return 2;
+}
+
+// Decodes up to n records straight into row i of a set of column tensors.
+// Columns are given as an array of { path = "a.b", tensor = t [, mask = m] }
+// where the optional ByteTensor mask records which rows had the field.
+// Returns the number of rows filled and the offset after the last record.
+static int thrift_read_columns(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   thrift_tensor_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   luaL_checktype(L, 3, LUA_TTABLE);
+   lua_Integer n = luaL_optinteger(L, 4, -1);
+   int framed = lua_toboolean(L, 5);
+   if (desc->ttype != TTYPE_STRUCT || desc->num_fields == 0) return LUA_HANDLE_ERROR_STR(L, "columns need a struct schema");
+   columns_t cols;
+   memset(&cols, 0, sizeof(cols));
+   cols.num_columns = lua_objlen(L, 3);
+   int max_nodes = 1;
+   for (int c = 1; c <= cols.num_columns; c++) {
+      lua_rawgeti(L, 3, c);
+      luaL_checktype(L, -1, LUA_TTABLE);
+      lua_getfield(L, -1, "path");
+      const char *path = lua_tostring(L, -1);
+      for (max_nodes++; path && *path; path++) {
+         if (*path == '.') max_nodes++;
+      }
+      lua_pop(L, 2);
+   }
+   // one collectable block so nothing leaks when a column is rejected
+   size_t cb = cols.num_columns * (2 * sizeof(tensor_view_t) + 1) + max_nodes * sizeof(column_node_t);
+   uint8_t *block = (uint8_t *)lua_newuserdata(L, cb);
+   memset(block, 0, cb);
+   cols.values = (tensor_view_t *)block;
+   cols.masks = cols.values + cols.num_columns;
+   cols.nodes = (column_node_t *)(cols.masks + cols.num_columns);
+   cols.seen = (uint8_t *)(cols.nodes + max_nodes);
+   cols.nodes[0].column = -1;
+   cols.nodes[0].first_child = -1;
+   cols.nodes[0].next_sibling = -1;
+   cols.num_nodes = 1;
+   long rows = n < 0 ? LONG_MAX : (long)n;
+   for (int c = 0; c < cols.num_columns; c++) {
+      lua_rawgeti(L, 3, c + 1);
+      lua_getfield(L, -1, "path");
+      thrift_columns_add(L, desc, &cols, c);
+      lua_pop(L, 1);
+      lua_getfield(L, -1, "tensor");
+      thrift_tensor_view(L, lua_gettop(L), &cols.values[c]);
+      rows = cols.values[c].size < rows ? cols.values[c].size : rows;
+      lua_pop(L, 1);
+      lua_getfield(L, -1, "mask");
+      if (!lua_isnil(L, -1)) {
+         thrift_tensor_view(L, lua_gettop(L), &cols.masks[c]);
+         if (cols.masks[c].kind != TENSOR_BYTE) return LUA_HANDLE_ERROR_STR(L, "masks must be ByteTensors");
+         rows = cols.masks[c].size < rows ? cols.masks[c].size : rows;
+      }
+      lua_pop(L, 2);
+   }
+   if (desc->threads > 1) return thrift_read_columns_threads(L, &in, &cols, rows, framed, desc->threads);
+   long row = 0;
+   while (row < rows && in.cb < in.max_cb) {
+      buffer_t record;
+      int ret = thrift_frame_begin(&in, framed, &record);
+      if (ret == 0) ret = thrift_read_columns_row(&record, &cols, row);
+      if (ret) return LUA_HANDLE_ERROR(L, ret);
+      thrift_frame_end(&in, framed, &record);
+      row++;
+   }
+   lua_pushinteger(L, row);
+   lua_pushinteger(L, in.cb);
+   return 2;
+}
+
+// Sparse batches gather one numeric map field of every record into CSR
+// form: row offsets, column indices taken from the map keys and values.
+// The index and value tensors grow geometrically as entries arrive.
+typedef struct sparse_t {
+   desc_t *path[THRIFT_MAX_DEPTH];
+   int depth;
+   THLongTensor *offsets;
+   THLongTensor *indices;
+   THDoubleTensor *values;
+   THFloatTensor *floats;
+   long rows;
+   long nnz;
+   long capacity;
+} sparse_t;
+
+static void thrift_sparse_reserve(sparse_t *sp, long n) {
+   if (sp->nnz + n <= sp->capacity) return;
+   sp->capacity = MAX(sp->nnz + n, 2 * sp->capacity);
+   THLongTensor_resize1d(sp->indices, sp->capacity);
+   if (sp->floats) THFloatTensor_resize1d(sp->floats, sp->capacity);
+   else THDoubleTensor_resize1d(sp->values, sp->capacity);
+}
+
+static int thrift_read_sparse_map(buffer_t *in, sparse_t *sp) {
+   uint8_t kt, vt;
+   int32_t count;
+   CTRY(proto_read_map_begin(in, &kt, &vt, &count))
+   if (count == 0) return 0;
+   if (kt == TTYPE_DOUBLE || array_width(kt) == 0 || array_width(vt) == 0) return -EINVAL;
+   if (proto_min_size(in->protocol, kt, count) + proto_min_size(in->protocol, vt, count) > in->max_cb - in->cb) return -ENOMEM;
+   thrift_sparse_reserve(sp, count);
+   long *indices = THLongTensor_data(sp->indices) + sp->nnz;
+   if (kt == TTYPE_I64 && vt == TTYPE_DOUBLE && sp->floats == NULL) {
+      CTRY(proto_read_pairs(in, kt, indices, vt, THDoubleTensor_data(sp->values) + sp->nnz, count))
+   } else {
+      for (int32_t i = 0; i < count; i++) {
+         int64_t i64;
+         double d;
+         CTRY(proto_read_scalar(in, kt, &i64, &d))
+         indices[i] = i64;
+         int ret = proto_read_scalar(in, vt, &i64, &d);
+         if (ret < 0) return ret;
+         if (!ret) d = i64;
+         if (sp->floats) THFloatTensor_data(sp->floats)[sp->nnz + i] = d;
+         else THDoubleTensor_data(sp->values)[sp->nnz + i] = d;
+      }
+   }
+   sp->nnz += count;
+   return 0;
+}
+
+// Adds the map at the end of the path in one record as the next row, an
+// empty one when the record does not have it, and skips the rest.
+static int thrift_read_sparse_row(buffer_t *in, sparse_t *sp) {
+   int16_t last_fid[THRIFT_MAX_DEPTH];
+   int open = 0;
+   uint8_t vt = TTYPE_STOP;
+   uint16_t fid;
+   while (open < sp->depth) {
+      desc_t *field = sp->path[open];
+      last_fid[open] = 0;
+      CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid[open]))
+      while (vt != TTYPE_STOP && (fid != field->field_id || vt != field->ttype)) {
+         CTRY(thrift_skip(in, vt, open + 1))
+         CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid[open]))
+      }
+      if (vt == TTYPE_STOP) break;
+      open++;
+   }
+   if (open == sp->depth) CTRY(thrift_read_sparse_map(in, sp))
+   // finish the structs the path went into
+   while (open-- > 0) {
+      CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid[open]))
+      while (vt != TTYPE_STOP) {
+         CTRY(thrift_skip(in, vt, open + 1))
+         CTRY(proto_read_field_begin(in, &vt, &fid, &last_fid[open]))
+      }
+   }
+   if (sp->rows + 2 > THLongTensor_size(sp->offsets, 0)) {
+      THLongTensor_resize1d(sp->offsets, 2 * (sp->rows + 2));
+   }
+   THLongTensor_data(sp->offsets)[++sp->rows] = sp->nnz;
+   return 0;
+}
+
+// Decodes a numeric map field, given by its dotted path, of back to back
+// records into a sparse CSR batch. Returns the row offsets, the column
+// indices, the values and the offset after the last record read. Takes
+// the same optional count and framed arguments as readBatch, and the
+// values come as a FloatTensor when the last argument is "float".
+static int thrift_read_sparse(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   thrift_tensor_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   const char *path = luaL_checkstring(L, 3);
+   lua_Integer n = luaL_optinteger(L, 4, -1);
+   int framed = lua_toboolean(L, 5);
+   const char *values = luaL_optstring(L, 6, "double");
+   sparse_t sp;
+   memset(&sp, 0, sizeof(sp));
+   while (*path) {
+      const char *end = strchr(path, '.');
+      size_t len = end ? (size_t)(end - path) : strlen(path);
+      if (desc->ttype != TTYPE_STRUCT) return LUA_HANDLE_ERROR_STR(L, "field path goes through a non struct field");
+      desc_t *field = thrift_desc_find(desc, path, len);
+      if (field == NULL) return LUA_HANDLE_ERROR_STR(L, "field path not found in schema");
+      if (sp.depth == THRIFT_MAX_DEPTH) return LUA_HANDLE_ERROR(L, ELOOP);
+      sp.path[sp.depth++] = field;
+      desc = field;
+      path += end ? len + 1 : len;
+   }
+   if (sp.depth == 0 || desc->ttype != TTYPE_MAP) return LUA_HANDLE_ERROR_STR(L, "sparse batches need a map field");
+   sp.offsets = THLongTensor_newWithSize1d(64);
+   luaT_pushudata(L, sp.offsets, "torch.LongTensor");
+   THLongTensor_data(sp.offsets)[0] = 0;
+   sp.indices = THLongTensor_new();
+   luaT_pushudata(L, sp.indices, "torch.LongTensor");
+   if (strcmp(values, "float") == 0) {
+      sp.floats = THFloatTensor_new();
+      luaT_pushudata(L, sp.floats, "torch.FloatTensor");
+   } else if (strcmp(values, "double") == 0) {
+      sp.values = THDoubleTensor_new();
+      luaT_pushudata(L, sp.values, "torch.DoubleTensor");
+   } else {
+      return LUA_HANDLE_ERROR_STR(L, "sparse values must be float or double");
+   }
+   while (in.cb < in.max_cb && (n < 0 || sp.rows < n)) {
+      buffer_t record;
+      int ret = thrift_frame_begin(&in, framed, &record);
+      if (ret == 0) ret = thrift_read_sparse_row(&record, &sp);
+      if (ret) return LUA_HANDLE_ERROR(L, ret);
+      thrift_frame_end(&in, framed, &record);
+   }
+   THLongTensor_resize1d(sp.offsets, sp.rows + 1);
+   if (sp.nnz > 0) {
+      THLongTensor_resize1d(sp.indices, sp.nnz);
+      if (sp.floats) THFloatTensor_resize1d(sp.floats, sp.nnz);
+      else THDoubleTensor_resize1d(sp.values, sp.nnz);
+   }
+   lua_pushinteger(L, in.cb);
+   return 4;
+}
+
+#if LUA_VERSION_NUM == 501
+#define lua_getuservalue lua_getfenv
+#define lua_setuservalue lua_setfenv
+#endif
+
+// Lazy values find where the fields or elements of a struct or container
+// start in one skipping pass, and decode each of them only on access.
+// Lists of fixed width values need no index at all.
+typedef struct lazy_entry_t {
+   size_t offset;
+   size_t size;
+   uint16_t field_id;
+   uint8_t ttype;
+   uint8_t pending_bool;
+} lazy_entry_t;
+
+typedef struct lazy_t {
+   desc_t *desc;
+   THByteStorage *storage;
+   const uint8_t *data;
+   size_t begin;
+   size_t end;
+   size_t first;
+   size_t width;
+   int flags;
+   int32_t count;
+   int32_t num_entries;
+   uint8_t protocol;
+   uint8_t ttype;
+   uint8_t value_ttype;
+   lazy_entry_t entries[];
+} lazy_t;
+
+// Pushes a lazy proxy for the struct or container in the input, or the
+// decoded value for anything else. env is the stack index of the table
+// that keeps the codec and the input alive.
+static int thrift_lazy_push(lua_State *L, int env, desc_t *desc, uint8_t ttype, buffer_t *in, int flags, THByteStorage *storage) {
+   buffer_t scan = *in;
+   int32_t count = 0, num_entries = 0;
+   uint8_t kt = TTYPE_STOP, vt = TTYPE_STOP;
+   size_t width = 0;
+   switch (ttype) {
+      case TTYPE_STRUCT:
+         if (desc && desc->num_fields > 0) {
+            num_entries = desc->num_fields;
+         } else {
+            // without a schema fields are kept in wire order, count them first
+            int16_t last_fid = 0;
+            uint16_t fid;
+            TRY(L, proto_read_field_begin(&scan, &vt, &fid, &last_fid))
+            while (vt != TTYPE_STOP) {
+               TRY(L, thrift_skip(&scan, vt, 0))
+               num_entries++;
+               TRY(L, proto_read_field_begin(&scan, &vt, &fid, &last_fid))
+            }
+            scan = *in;
+         }
+         break;
+      case TTYPE_MAP:
+         TRY(L, proto_read_map_begin(&scan, &kt, &vt, &count))
+         if (proto_min_size(in->protocol, kt, count) + proto_min_size(in->protocol, vt, count) > scan.max_cb - scan.cb) return LUA_HANDLE_ERROR(L, ENOMEM);
+         num_entries = 2 * count;
+         break;
+      case TTYPE_SET:
+      case TTYPE_LIST:
+         TRY(L, proto_read_list_begin(&scan, &vt, &count))
+         if ((flags & LIST_AND_SET_AS_TENSOR) && array_width(vt)) {
+            // numeric lists become tensors in one go
+            return thrift_read_value(L, ttype, in, flags, desc);
+         }
+         if (proto_min_size(in->protocol, vt, count) > scan.max_cb - scan.cb) return LUA_HANDLE_ERROR(L, ENOMEM);
+         width = vt == TTYPE_BOOL ? 0 : proto_fixed_size(in->protocol, vt);
+         num_entries = width ? 0 : count;
+         break;
+      default:
+         return thrift_read_value(L, ttype, in, flags, desc);
+   }
+   size_t bytes = sizeof(lazy_t) + (size_t)num_entries * sizeof(lazy_entry_t);
+   lazy_t *lazy = (lazy_t *)lua_newuserdata(L, bytes);
+   memset(lazy, 0, bytes);
+   luaL_getmetatable(L, "thrift.lazy");
+   lua_setmetatable(L, -2);
+   lua_pushvalue(L, env);
+   lua_setuservalue(L, -2);
+   if (storage) {
+      THByteStorage_retain(storage);
+      lazy->storage = storage;
+   }
+   lazy->desc = desc;
+   lazy->data = in->data;
+   lazy->begin = in->cb;
+   lazy->flags = flags;
+   lazy->num_entries = num_entries;
+   lazy->protocol = in->protocol;
+   lazy->ttype = ttype;
+   switch (ttype) {
+      case TTYPE_STRUCT: {
+         uint16_t hint = 0;
+         int16_t last_fid = 0;
+         uint16_t fid;
+         TRY(L, proto_read_field_begin(&scan, &vt, &fid, &last_fid))
+         while (vt != TTYPE_STOP) {
+            lazy_entry_t *entry = NULL;
+            if (desc && desc->num_fields > 0) {
+               desc_t *field = thrift_desc_field(desc, fid, &hint);
+               if (field == NULL && !(flags & PROJECTION)) return LUA_HANDLE_ERROR_STR(L, "field id value out of range for struct");
+               if (field && (field->ttype == vt || !(flags & PROJECTION))) entry = &lazy->entries[field - desc->fields];
+            } else {
+               entry = &lazy->entries[lazy->count];
+            }
+            size_t offset = scan.cb;
+            uint8_t pending_bool = scan.pending_bool;
+            TRY(L, thrift_skip(&scan, vt, 0))
+            if (entry) {
+               if (entry->ttype == TTYPE_STOP) lazy->count++;
+               entry->offset = offset;
+               entry->size = scan.cb - offset;
+               entry->field_id = fid;
+               entry->ttype = vt;
+               entry->pending_bool = pending_bool;
+            }
+            TRY(L, proto_read_field_begin(&scan, &vt, &fid, &last_fid))
+         }
+         break;
+      }
+      case TTYPE_MAP:
+         for (int32_t i = 0; i < num_entries; i++) {
+            lazy_entry_t *entry = &lazy->entries[i];
+            entry->offset = scan.cb;
+            entry->ttype = (i & 1) ? vt : kt;
+            TRY(L, thrift_skip(&scan, entry->ttype, 0))
+            entry->size = scan.cb - entry->offset;
+         }
+         lazy->count = count;
+         break;
+      default:
+         lazy->first = scan.cb;
+         lazy->width = width;
+         lazy->value_ttype = vt;
+         if (width) {
+            scan.cb += (size_t)count * width;
+         }
+         for (int32_t i = 0; i < num_entries; i++) {
+            lazy_entry_t *entry = &lazy->entries[i];
+            entry->offset = scan.cb;
+            entry->ttype = vt;
+            TRY(L, thrift_skip(&scan, vt, 0))
+            entry->size = scan.cb - entry->offset;
+         }
+         lazy->count = count;
+         break;
+   }
+   lazy->end = scan.cb;
+   in->cb = scan.cb;
+   return 1;
+}
+
+// Decodes the value at offset of a lazy proxy at stack index 1 with the
+// given flags, nested structs and containers become proxies over the same
+// input.
+static int thrift_lazy_value(lua_State *L, lazy_t *lazy, uint8_t ttype, desc_t *desc, size_t offset, size_t size, uint8_t pending_bool, int flags) {
+   buffer_t in;
+   memset(&in, 0, sizeof(buffer_t));
+   in.data = (uint8_t *)lazy->data;
+   in.cb = offset;
+   in.max_cb = offset + size;
+   in.protocol = lazy->protocol;
+   in.pending_bool = pending_bool;
+   in.owner = lazy->storage;
+   lua_getuservalue(L, 1);
+   int env = lua_gettop(L);
+   if (thrift_lazy_push(L, env, desc, ttype, &in, flags, lazy->storage) == 0) lua_pushnil(L);
+   lua_remove(L, env);
+   return 1;
+}
+
+static int thrift_lazy_index(lua_State *L) {
+   lazy_t *lazy = (lazy_t *)luaL_checkudata(L, 1, "thrift.lazy");
+   desc_t *desc = lazy->desc;
+   switch (lazy->ttype) {
+      case TTYPE_STRUCT: {
+         lazy_entry_t *entry = NULL;
+         desc_t *field = NULL;
+         if (desc && desc->num_fields > 0) {
+            // named fields are only found by name, just like in codec:read
+            if (lua_type(L, 2) == LUA_TSTRING) {
+               const char *key = lua_tostring(L, 2);
+               for (uint16_t i = 0; i < desc->num_fields && field == NULL; i++) {
+                  if (desc->fields[i].field_name && strcmp(desc->fields[i].field_name, key) == 0) field = &desc->fields[i];
+               }
+            } else if (lua_type(L, 2) == LUA_TNUMBER) {
+               lua_Integer fid = lua_tointeger(L, 2);
+               uint16_t hint = 0;
+               if (fid >= 0 && fid <= UINT16_MAX) field = thrift_desc_field(desc, (uint16_t)fid, &hint);
+               if (field && field->field_name) field = NULL;
+            }
+            if (field) entry = &lazy->entries[field - desc->fields];
+         } else if (lua_type(L, 2) == LUA_TNUMBER) {
+            lua_Integer fid = lua_tointeger(L, 2);
+            for (int32_t i = 0; i < lazy->count; i++) {
+               if (lazy->entries[i].field_id == fid) entry = &lazy->entries[i];
+            }
+         }
+         if (entry == NULL || entry->ttype == TTYPE_STOP) break;
+         return thrift_lazy_value(L, lazy, entry->ttype, field, entry->offset, entry->size, entry->pending_bool, lazy->flags);
+      }
+      case TTYPE_MAP: {
+         // keys are decoded one by one, later duplicates win as in codec:read
+         for (int32_t i = lazy->count - 1; i >= 0; i--) {
+            lazy_entry_t *key = &lazy->entries[2 * i];
+            // keys stay strings like in codec:read, views would never compare equal
+            thrift_lazy_value(L, lazy, key->ttype, desc ? desc->key_ttype : NULL, key->offset, key->size, 0, lazy->flags & ~STRINGS_AS_TENSORS);
+            int equal = lua_rawequal(L, 2, -1);
+            lua_pop(L, 1);
+            if (equal) {
+               lazy_entry_t *value = key + 1;
+               return thrift_lazy_value(L, lazy, value->ttype, desc ? desc->value_ttype : NULL, value->offset, value->size, 0, lazy->flags);
+            }
+         }
+         break;
+      }
+      default: {
+         if (lua_type(L, 2) != LUA_TNUMBER) break;
+         lua_Integer i = lua_tointeger(L, 2);
+         if (i < 1 || i > lazy->count) break;
+         desc_t *value_desc = desc ? desc->value_ttype : NULL;
+         if (lazy->width) {
+            return thrift_lazy_value(L, lazy, lazy->value_ttype, value_desc, lazy->first + (size_t)(i - 1) * lazy->width, lazy->width, 0, lazy->flags);
+         }
+         lazy_entry_t *entry = &lazy->entries[i - 1];
+         return thrift_lazy_value(L, lazy, entry->ttype, value_desc, entry->offset, entry->size, 0, lazy->flags);
+      }
+   }
+   lua_pushnil(L);
+   return 1;
+}
+
+// Number of fields present in a struct, or of elements in a container.
+static int thrift_lazy_len(lua_State *L) {
+   lazy_t *lazy = (lazy_t *)luaL_checkudata(L, 1, "thrift.lazy");
+   lua_pushinteger(L, lazy->count);
+   return 1;
+}
+
+// Calling a proxy decodes all of it, the same as codec:read would.
+static int thrift_lazy_call(lua_State *L) {
+   lazy_t *lazy = (lazy_t *)luaL_checkudata(L, 1, "thrift.lazy");
+   buffer_t in;
+   memset(&in, 0, sizeof(buffer_t));
+   in.data = (uint8_t *)lazy->data;
+   in.cb = lazy->begin;
+   in.max_cb = lazy->end;
+   in.protocol = lazy->protocol;
+   in.owner = lazy->storage;
+   return thrift_read_value(L, lazy->ttype, &in, lazy->flags, lazy->desc);
+}
+
+static int thrift_lazy_gc(lua_State *L) {
+   lazy_t *lazy = (lazy_t *)lua_touserdata(L, 1);
+   if (lazy->storage) THByteStorage_free(lazy->storage);
+   return 0;
+}
+
+// Returns a proxy that decodes fields and elements on access. The proxy
+// keeps the codec and the input string or ByteTensor alive.
+static int thrift_read_lazy(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   THByteStorage *storage = NULL;
+   if (!thrift_source_buffer(L, 2, &in)) {
+      storage = ((THByteTensor *)luaT_toudata(L, 2, "torch.ByteTensor"))->storage;
+   }
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
+   lua_createtable(L, 2, 0);
+   lua_pushvalue(L, 1);
+   lua_rawseti(L, -2, 1);
+   lua_pushvalue(L, 2);
+   lua_rawseti(L, -2, 2);
+   return thrift_lazy_push(L, lua_gettop(L), desc, desc->ttype, &in, desc->flags, storage);
+}
+
+// Decodes the single field at a dotted path of field names or ids,
+// skipping everything else. Returns nil when the field is absent.
+static int thrift_get(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   int flags = desc->flags;
+   buffer_t in;
+   thrift_source_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(flags);
+   const char *path = luaL_checkstring(L, 3);
+   while (*path) {
+      const char *end = strchr(path, '.');
+      size_t len = end ? (size_t)(end - path) : strlen(path);
+      if (desc->ttype != TTYPE_STRUCT) return LUA_HANDLE_ERROR_STR(L, "field path goes through a non struct field");
+      desc_t *field = thrift_desc_find(desc, path, len);
+      if (field == NULL) return LUA_HANDLE_ERROR_STR(L, "field path not found in schema");
+      int16_t last_fid = 0;
+      uint8_t vt;
+      uint16_t fid;
+      TRY(L, proto_read_field_begin(&in, &vt, &fid, &last_fid))
+      while (vt != TTYPE_STOP && (fid != field->field_id || vt != field->ttype)) {
+         TRY(L, thrift_skip(&in, vt, 0))
+         TRY(L, proto_read_field_begin(&in, &vt, &fid, &last_fid))
+      }
+      if (vt == TTYPE_STOP) {
+         lua_pushnil(L);
+         return 1;
+      }
+      desc = field;
+      path += end ? len + 1 : len;
+   }
+   return thrift_read_value(L, desc->ttype, &in, flags, desc);
+}
+
+static const luaL_Reg thrift_lazy_routines[] = {
+   {"__index", thrift_lazy_index},
+   {"__len", thrift_lazy_len},
+   {"__call", thrift_lazy_call},
+   {"__gc", thrift_lazy_gc},
+   {NULL, NULL}
+};
+
+// Record files are mapped into memory and decoded in place. The offsets of
+// records seen so far are remembered, so any record can be read by index.
+typedef struct file_t {
+   desc_t *desc;
+   uint8_t *data;
+   size_t size;
+   size_t cb;
+   size_t scanned;
+   size_t *offsets;
+   size_t num_offsets;
+   size_t max_offsets;
+   int framed;
+   int random;
+   int closed;
+} file_t;
+
+static file_t *thrift_file_check(lua_State *L, int index) {
+   file_t *file = (file_t *)luaL_checkudata(L, index, "thrift.file");
+   if (file->closed) LUA_HANDLE_ERROR_STR(L, "file is closed");
+   return file;
+}
+
+static void thrift_file_unmap(file_t *file) {
+   if (file->data) munmap(file->data, file->size);
+   free(file->offsets);
+   file->data = NULL;
+   file->offsets = NULL;
+   file->closed = 1;
+}
+
+// Narrows record to the record that starts at offset.
+static int thrift_file_record(file_t *file, size_t offset, buffer_t *record) {
+   buffer_t in;
+   memset(&in, 0, sizeof(buffer_t));
+   in.data = file->data;
+   in.cb = offset;
+   in.max_cb = file->size;
+   in.protocol = THRIFT_PROTOCOL(file->desc->flags);
+   return thrift_frame_begin(&in, file->framed, record);
+}
+
+// Records the record that spans offset to end when it is the next one
+// past the scanned part of the file.
+static int thrift_file_push(file_t *file, size_t offset, size_t end) {
+   if (end <= offset) return -EINVAL;
+   if (offset != file->scanned) return 0;
+   if (file->num_offsets == file->max_offsets) {
+      size_t max_offsets = MAX(file->max_offsets * 2, 64);
+      size_t *offsets = (size_t *)realloc(file->offsets, max_offsets * sizeof(size_t));
+      if (offsets == NULL) return -ENOMEM;
+      file->offsets = offsets;
+      file->max_offsets = max_offsets;
+   }
+   file->offsets[file->num_offsets++] = offset;
+   file->scanned = end;
+   return 0;
+}
+
+// Extends the offset index until it holds n records or the file ends.
+static int thrift_file_index(file_t *file, size_t n) {
+   while (file->num_offsets < n && file->scanned < file->size) {
+      buffer_t record;
+      CTRY(thrift_file_record(file, file->scanned, &record))
+      if (!file->framed) CTRY(thrift_skip(&record, file->desc->ttype, 0))
+      CTRY(thrift_file_push(file, file->scanned, file->framed ? record.max_cb : record.cb))
+   }
+   return 0;
+}
+
+// Decodes the record at offset and returns the offset one past it.
+static size_t thrift_file_read(lua_State *L, file_t *file, size_t offset) {
+   buffer_t record;
+   TRY(L, thrift_file_record(file, offset, &record))
+   desc_t *desc = file->desc;
+   if (thrift_read_value(L, desc->ttype, &record, desc->flags, desc) == 0) lua_pushnil(L);
+   thrift_stats_record(desc, record.cb - offset, 0, 0);
+   size_t end = file->framed ? record.max_cb : record.cb;
+   TRY(L, thrift_file_push(file, offset, end))
+   return end;
+}
+
+// Calling the file returns its next record, or nil at the end, so that it
+// can drive a generic for loop.
+static int thrift_file_next(lua_State *L) {
+   file_t *file = thrift_file_check(L, 1);
+   if (file->cb >= file->size) return 0;
+   file->cb = thrift_file_read(L, file, file->cb);
+   return 1;
+}
+
+// Reads the i-th record, counting from 1. The first random access switches
+// the mapping from sequential to random read ahead.
+static int thrift_file_read_index(lua_State *L) {
+   file_t *file = thrift_file_check(L, 1);
+   lua_Integer i = luaL_checkinteger(L, 2);
+   if (i < 1) return 0;
+   if (!file->random && file->data) {
+      madvise(file->data, file->size, MADV_RANDOM);
+      file->random = 1;
+   }
+   TRY(L, thrift_file_index(file, (size_t)i))
+   if ((size_t)i > file->num_offsets) return 0;
+   thrift_file_read(L, file, file->offsets[i - 1]);
+   return 1;
+}
+
+// Number of records in the file, which indexes all of them.
+static int thrift_file_count(lua_State *L) {
+   file_t *file = thrift_file_check(L, 1);
+   TRY(L, thrift_file_index(file, SIZE_MAX))
+   lua_pushinteger(L, file->num_offsets);
+   return 1;
+}
+
+// Moves the iterator back to the first record.
+static int thrift_file_rewind(lua_State *L) {
+   file_t *file = thrift_file_check(L, 1);
+   file->cb = 0;
+   if (file->random && file->data) {
+      madvise(file->data, file->size, MADV_SEQUENTIAL);
+      file->random = 0;
+   }
+   return 0;
+}
+
+static int thrift_file_close(lua_State *L) {
+   file_t *file = (file_t *)luaL_checkudata(L, 1, "thrift.file");
+   thrift_file_unmap(file);
+   return 0;
+}
+
+// Maps a file of back to back records, each optionally preceded by its
+// big-endian i32 length, and returns an iterator over them.
+static int thrift_open_file(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   const char *path = luaL_checkstring(L, 2);
+   file_t *file = (file_t *)lua_newuserdata(L, sizeof(file_t));
+   memset(file, 0, sizeof(file_t));
+   file->desc = desc;
+   file->framed = lua_toboolean(L, 3);
+   file->closed = 1;
+   luaL_getmetatable(L, "thrift.file");
+   lua_setmetatable(L, -2);
+   // the file keeps its codec alive
+   lua_createtable(L, 1, 0);
+   lua_pushvalue(L, 1);
+   lua_rawseti(L, -2, 1);
+   lua_setuservalue(L, -2);
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) return LUA_HANDLE_ERROR(L, errno);
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      int err = errno;
+      close(fd);
+      return LUA_HANDLE_ERROR(L, err);
+   }
+   if (st.st_size > 0) {
+      void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+         int err = errno;
+         close(fd);
+         return LUA_HANDLE_ERROR(L, err);
+      }
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      file->data = (uint8_t *)data;
+      file->size = st.st_size;
+   }
+   close(fd);
+   file->closed = 0;
+   return 1;
+}
+
+static int thrift_file_gc(lua_State *L) {
+   file_t *file = (file_t *)lua_touserdata(L, 1);
+   thrift_file_unmap(file);
+   return 0;
+}
+
+static const luaL_Reg thrift_file_routines[] = {
+   {"read", thrift_file_read_index},
+   {"count", thrift_file_count},
+   {"rewind", thrift_file_rewind},
+   {"close", thrift_file_close},
+   {"__call", thrift_file_next},
+   {"__len", thrift_file_count},
+   {"__gc", thrift_file_gc},
+   {NULL, NULL}
+};
+
+// Block files are mapped like record files, but hold their records in
+// compressed blocks. A background thread decompresses the blocks ahead of
+// the one being decoded into a ring of reusable buffers, so decoding and
+// decompression overlap.
+#define THRIFT_MAX_PREFETCH (16)
+
+// Blocks are cut at a megabyte by default, larger raw sizes than this are
+// taken for corruption unless openBlockFile is told otherwise.
+#define THRIFT_MAX_BLOCK_SIZE (256 << 20)
+
+typedef struct block_slot_t {
+   uint8_t *data;
+   size_t size;
+   size_t max_size;
+   size_t block;
+   int ready;
+   int ret;
+} block_slot_t;
+
+typedef struct block_file_t {
+   desc_t *desc;
+   uint8_t *data;
+   size_t size;
+   int compression;
+   size_t max_block_size;
+   size_t num_blocks;
+   size_t *offsets;
+   size_t num_records;
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   int running;
+   int stop;
+   size_t next_block;
+   block_slot_t slots[THRIFT_MAX_PREFETCH];
+   int depth;
+   size_t block;
+   size_t cb;
+   int current;
+   int closed;
+} block_file_t;
+
+static block_file_t *thrift_block_file_check(lua_State *L, int index) {
+   block_file_t *file = (block_file_t *)luaL_checkudata(L, index, "thrift.blockfile");
+   if (file->closed) LUA_HANDLE_ERROR_STR(L, "file is closed");
+   return file;
+}
+
+// Decompresses a block into a slot, growing its buffer only when the block
+// is larger than any before it.
+static int thrift_block_load(block_file_t *file, size_t block, block_slot_t *slot) {
+   const uint8_t *frame = file->data + file->offsets[block];
+   size_t compressed = block_get_u32(frame), raw = block_get_u32(frame + 4);
+   if (raw > slot->max_size) {
+      uint8_t *data = (uint8_t *)realloc(slot->data, raw);
+      if (data == NULL) return -ENOMEM;
+      slot->data = data;
+      slot->max_size = raw;
+   }
+   slot->size = raw;
+   return block_decompress(file->compression, frame + BLOCK_FRAME_SIZE, compressed, slot->data, raw);
+}
+
+static void *thrift_block_prefetch(void *arg) {
+   block_file_t *file = (block_file_t *)arg;
+   pthread_mutex_lock(&file->mutex);
+   while (!file->stop && file->next_block < file->num_blocks) {
+      block_slot_t *slot = &file->slots[file->next_block % file->depth];
+      if (slot->ready) {
+         pthread_cond_wait(&file->cond, &file->mutex);
+         continue;
+      }
+      size_t block = file->next_block++;
+      pthread_mutex_unlock(&file->mutex);
+      int ret = thrift_block_load(file, block, slot);
+      pthread_mutex_lock(&file->mutex);
+      slot->block = block;
+      slot->ret = ret;
+      slot->ready = 1;
+      pthread_cond_broadcast(&file->cond);
+   }
+   pthread_mutex_unlock(&file->mutex);
+   return NULL;
+}
+
+// Stops the prefetch thread and empties every slot, so reading can start
+// over at any block.
+static void thrift_block_stop(block_file_t *file) {
+   if (file->running) {
+      pthread_mutex_lock(&file->mutex);
+      file->stop = 1;
+      pthread_cond_broadcast(&file->cond);
+      pthread_mutex_unlock(&file->mutex);
+      pthread_join(file->thread, NULL);
+      file->running = 0;
+   }
+   file->stop = 0;
+   for (int i = 0; i < file->depth; i++) {
+      file->slots[i].ready = 0;
+   }
+   file->current = 0;
+}
+
+static void thrift_block_unmap(block_file_t *file) {
+   if (file->closed) return;
+   thrift_block_stop(file);
+   for (int i = 0; i < file->depth; i++) {
+      free(file->slots[i].data);
+   }
+   if (file->data) munmap(file->data, file->size);
+   free(file->offsets);
+   pthread_mutex_destroy(&file->mutex);
+   pthread_cond_destroy(&file->cond);
+   file->data = NULL;
+   file->offsets = NULL;
+   file->closed = 1;
+}
+
+// Checks the header, footer and index of a mapped block file and keeps the
+// offset of every block.
+static int thrift_block_index(block_file_t *file) {
+   if (file->size < BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE) return -EINVAL;
+   const uint8_t *footer = file->data + file->size - BLOCK_FOOTER_SIZE;
+   if (block_get_u32(file->data) != BLOCK_MAGIC || block_get_u32(footer + 12) != BLOCK_MAGIC) return -EINVAL;
+   if (file->data[4] != BLOCK_VERSION) return -EINVAL;
+   file->compression = file->data[5];
+   if (!block_supported(file->compression)) return -ENOTSUP;
+   uint64_t index = block_get_u64(footer);
+   file->num_blocks = block_get_u32(footer + 8);
+   // offsets come from the file, so bounds are checked by subtracting and
+   // never by adding to them, which could wrap
+   size_t end = file->size - BLOCK_FOOTER_SIZE;
+   if (index < BLOCK_HEADER_SIZE || index > end || end - index != (uint64_t)file->num_blocks * BLOCK_INDEX_SIZE) return -EINVAL;
+   file->offsets = (size_t *)malloc(MAX(file->num_blocks, 1) * sizeof(size_t));
+   if (file->offsets == NULL) return -ENOMEM;
+   for (size_t i = 0; i < file->num_blocks; i++) {
+      const uint8_t *entry = file->data + index + i * BLOCK_INDEX_SIZE;
+      uint64_t offset = block_get_u64(entry);
+      if (offset < BLOCK_HEADER_SIZE || index < BLOCK_FRAME_SIZE || offset > index - BLOCK_FRAME_SIZE) return -EINVAL;
+      const uint8_t *frame = file->data + offset;
+      size_t compressed = block_get_u32(frame), raw = block_get_u32(frame + 4);
+      if (compressed > index - BLOCK_FRAME_SIZE - offset) return -EINVAL;
+      // raw sizes are what prefetch slots get allocated to
+      if (raw > file->max_block_size || raw > block_max_raw(file->compression, compressed)) return -EINVAL;
+      if (block_get_u32(frame + 8) != block_get_u32(entry + 8)) return -EINVAL;
+      file->offsets[i] = offset;
+      file->num_records += block_get_u32(entry + 8);
+   }
+   return 0;
+}
+
+// Calling the file returns its next record, or nil at the end. Blocks are
+// handed back to the prefetch thread as soon as their last record is read.
+static int thrift_block_file_next(lua_State *L) {
+   block_file_t *file = thrift_block_file_check(L, 1);
+   while (1) {
+      block_slot_t *slot = &file->slots[file->block % file->depth];
+      if (file->current) {
+         if (file->cb < slot->size) {
+            buffer_t in, record;
+            memset(&in, 0, sizeof(buffer_t));
+            in.data = slot->data;
+            in.cb = file->cb;
+            in.max_cb = slot->size;
+            in.protocol = THRIFT_PROTOCOL(file->desc->flags);
+            TRY(L, thrift_frame_begin(&in, 1, &record))
+            desc_t *desc = file->desc;
+            if (thrift_read_value(L, desc->ttype, &record, desc->flags, desc) == 0) lua_pushnil(L);
+            thrift_stats_record(desc, record.max_cb - file->cb, 0, 0);
+            file->cb = record.max_cb;
+            return 1;
+         }
+         pthread_mutex_lock(&file->mutex);
+         slot->ready = 0;
+         pthread_cond_broadcast(&file->cond);
+         pthread_mutex_unlock(&file->mutex);
+         file->current = 0;
+         file->block++;
+         continue;
+      }
+      if (file->block >= file->num_blocks) return 0;
+      if (!file->running) {
+         file->next_block = file->block;
+         TRY(L, pthread_create(&file->thread, NULL, thrift_block_prefetch, file))
+         file->running = 1;
+      }
+      pthread_mutex_lock(&file->mutex);
+      while (!slot->ready || slot->block != file->block) {
+         pthread_cond_wait(&file->cond, &file->mutex);
+      }
+      pthread_mutex_unlock(&file->mutex);
+      file->current = 1;
+      file->cb = 0;
+      if (slot->ret) {
+         int ret = slot->ret;
+         // drop the broken block so a retry moves on to the next one
+         file->cb = slot->size = 0;
+         return LUA_HANDLE_ERROR(L, ret);
+      }
+   }
+}
+
+static int thrift_block_file_count(lua_State *L) {
+   block_file_t *file = thrift_block_file_check(L, 1);
+   lua_pushinteger(L, file->num_records);
+   return 1;
+}
+
+// Moves the iterator back to the first record.
+static int thrift_block_file_rewind(lua_State *L) {
+   block_file_t *file = thrift_block_file_check(L, 1);
+   thrift_block_stop(file);
+   file->block = 0;
+   file->cb = 0;
+   return 0;
+}
+
+static int thrift_block_file_close(lua_State *L) {
+   block_file_t *file = (block_file_t *)luaL_checkudata(L, 1, "thrift.blockfile");
+   thrift_block_unmap(file);
+   return 0;
+}
+
+// Maps a block file and returns an iterator over its records. The optional
+// second argument is the number of blocks decompressed ahead, 2 by default,
+// and the third one the largest raw block size the file may have.
+static int thrift_open_block_file(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   const char *path = luaL_checkstring(L, 2);
+   lua_Integer depth = luaL_optinteger(L, 3, 2);
+   if (depth < 1 || depth > THRIFT_MAX_PREFETCH) return LUA_HANDLE_ERROR_STR(L, "prefetch out of range");
+   lua_Integer max_block_size = luaL_optinteger(L, 4, THRIFT_MAX_BLOCK_SIZE);
+   if (max_block_size < 1 || max_block_size > UINT32_MAX) return LUA_HANDLE_ERROR_STR(L, "block size out of range");
+   block_file_t *file = (block_file_t *)lua_newuserdata(L, sizeof(block_file_t));
+   memset(file, 0, sizeof(block_file_t));
+   file->desc = desc;
+   file->depth = depth;
+   file->max_block_size = max_block_size;
+   file->closed = 1;
+   luaL_getmetatable(L, "thrift.blockfile");
+   lua_setmetatable(L, -2);
+   // the file keeps its codec alive
+   lua_createtable(L, 1, 0);
+   lua_pushvalue(L, 1);
+   lua_rawseti(L, -2, 1);
+   lua_setuservalue(L, -2);
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) return LUA_HANDLE_ERROR(L, errno);
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      int err = errno;
+      close(fd);
+      return LUA_HANDLE_ERROR(L, err);
+   }
+   void *data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+   int err = errno;
+   close(fd);
+   if (data == MAP_FAILED) return st.st_size > 0 ? LUA_HANDLE_ERROR(L, err) : LUA_HANDLE_ERROR_STR(L, "not a block file");
+   madvise(data, st.st_size, MADV_SEQUENTIAL);
+   file->data = (uint8_t *)data;
+   file->size = st.st_size;
+   pthread_mutex_init(&file->mutex, NULL);
+   pthread_cond_init(&file->cond, NULL);
+   file->closed = 0;
+   int ret = thrift_block_index(file);
+   if (ret == -EINVAL) return LUA_HANDLE_ERROR_STR(L, "not a block file");
+   TRY(L, ret)
+   return 1;
+}
+
+static int thrift_block_file_gc(lua_State *L) {
+   block_file_t *file = (block_file_t *)lua_touserdata(L, 1);
+   thrift_block_unmap(file);
+   return 0;
+}
+
+static const luaL_Reg thrift_block_file_routines[] = {
+   {"count", thrift_block_file_count},
+   {"rewind", thrift_block_file_rewind},
+   {"close", thrift_block_file_close},
+   {"__call", thrift_block_file_next},
+   {"__len", thrift_block_file_count},
+   {"__gc", thrift_block_file_gc},
+   {NULL, NULL}
+};
+
+// Returns the tensor of a numeric type, or NULL when the type has no tensor
+// representation.
+static THByteTensor *thrift_typed_tensor(lua_State *L, int index, uint8_t ttype) {
+   const char *tname = thrift_tensor_name(ttype);
+   if (tname == NULL) return NULL;
+   // every TH tensor type shares the same header layout
+   THByteTensor *values = (THByteTensor *)luaT_toudata(L, index, tname);
+   if (values == NULL) LUA_HANDLE_ERROR_STR(L, "expected a tensor");
+   return values;
+}
+
+// Returns the 1 dimensional tensor of the element type of a numeric list, or
+// NULL when the list element type has no tensor representation.
+static THByteTensor *thrift_list_tensor(lua_State *L, int index, uint8_t ttype) {
+   THByteTensor *values = thrift_typed_tensor(L, index, ttype);
+   if (values && values->nDimension > 1) LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional tensor");
+   return values;
 }
 
-static int thrift_write_rcsv(lua_State *L, int index, desc_t *desc, buffer_t *out, int flags, void *in) {
+// Empty tensors have no dimensions and possibly no storage.
+#define TENSOR_DATA(t, ttype) ((t)->storage ? (uint8_t *)(t)->storage->data + (t)->storageOffset * array_width(ttype) : NULL)
+#define TENSOR_SIZE(t) ((t)->nDimension ? (t)->size[0] : 0)
+#define TENSOR_STRIDE(t) ((t)->nDimension ? (t)->stride[0] : 1)
+
+// Finds the keys and values tensors of a numeric map written as such a
+// pair, returns 0 when the map is a plain table.
+static int thrift_map_tensors(lua_State *L, int index, desc_t *desc, int flags, THByteTensor **keys, THByteTensor **values) {
+   uint8_t kt = desc->key_ttype->ttype, vt = desc->value_ttype->ttype;
+   if (!(flags & MAP_AS_TENSORS) || array_width(kt) == 0 || array_width(vt) == 0) return 0;
+   lua_getfield(L, index, "keys");
+   if (lua_type(L, -1) != LUA_TUSERDATA) {
+      lua_pop(L, 1);
+      return 0;
+   }
+   lua_getfield(L, index, "values");
+   *keys = thrift_list_tensor(L, lua_gettop(L) - 1, kt);
+   *values = thrift_list_tensor(L, lua_gettop(L), vt);
+   lua_pop(L, 2);
+   if (TENSOR_SIZE(*keys) != TENSOR_SIZE(*values)) return LUA_HANDLE_ERROR_STR(L, "map keys and values differ in size");
+   return 1;
+}
+
+#define OFFSET(t, i) ((t)->storage->data[(t)->storageOffset + (i) * (t)->stride[0]])
+
+// Finds the tensors a nested list of numbers is written from in its shaped
+// form, returns 0 when the list is a plain table.
+static int thrift_shaped_tensors(lua_State *L, int index, desc_t *desc, THByteTensor **values, THLongTensor **offsets) {
+   if (desc->shape == SHAPE_FIXED) {
+      if (lua_type(L, index) != LUA_TUSERDATA) return 0;
+      *values = thrift_typed_tensor(L, index, desc->shape_ttype);
+      if ((*values)->nDimension != 0 && (*values)->nDimension != desc->shape_levels) return LUA_HANDLE_ERROR_STR(L, "tensor dimensions differ from the list levels");
+      return 1;
+   }
+   if (desc->shape != SHAPE_RAGGED) return 0;
+   lua_getfield(L, index, "offsets");
+   if (lua_type(L, -1) != LUA_TUSERDATA) {
+      lua_pop(L, 1);
+      return 0;
+   }
+   lua_getfield(L, index, "values");
+   *offsets = (THLongTensor *)luaT_toudata(L, lua_gettop(L) - 1, "torch.LongTensor");
+   *values = thrift_list_tensor(L, lua_gettop(L), desc->shape_ttype);
+   lua_pop(L, 2);
+   if (*offsets == NULL || (*offsets)->nDimension != 1) return LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional LongTensor of offsets");
+   long n = (*offsets)->size[0] - 1;
+   if (OFFSET(*offsets, 0) < 0 || OFFSET(*offsets, n) > TENSOR_SIZE(*values)) return LUA_HANDLE_ERROR_STR(L, "offsets out of range");
+   for (long i = 0; i < n; i++) {
+      if (OFFSET(*offsets, i) > OFFSET(*offsets, i + 1)) return LUA_HANDLE_ERROR_STR(L, "offsets must not decrease");
+   }
+   return 1;
+}
+
+// Sizes and writes a tensor of a fixed shape one level at a time, so it can
+// have any strides.
+static size_t thrift_size_fixed(uint8_t protocol, desc_t *desc, THByteTensor *t, int level, const uint8_t *data, size_t width) {
+   long n = t->nDimension ? t->size[level] : 0;
+   size_t size = proto_size_list_begin(protocol, n);
+   uint8_t et = desc->value_ttype->ttype;
+   if (array_width(et)) return size + proto_size_array(protocol, et, data, n, t->nDimension ? t->stride[level] : 1);
+   for (long i = 0; i < n; i++) {
+      size += thrift_size_fixed(protocol, desc->value_ttype, t, level + 1, data + i * t->stride[level] * width, width);
+   }
+   return size;
+}
+
+static int thrift_write_fixed(buffer_t *out, desc_t *desc, THByteTensor *t, int level, const uint8_t *data, size_t width) {
+   long n = t->nDimension ? t->size[level] : 0;
+   uint8_t et = desc->value_ttype->ttype;
+   CTRY(proto_write_list_begin(out, et, n))
+   if (array_width(et)) return proto_write_array(out, et, data, n, t->nDimension ? t->stride[level] : 1);
+   for (long i = 0; i < n; i++) {
+      CTRY(thrift_write_fixed(out, desc->value_ttype, t, level + 1, data + i * t->stride[level] * width, width))
+   }
+   return 0;
+}
+
+// Sizes and writes the values and offsets of ragged rows.
+static size_t thrift_size_ragged(uint8_t protocol, desc_t *desc, THByteTensor *values, THLongTensor *offsets) {
+   uint8_t et = desc->shape_ttype;
+   const uint8_t *data = TENSOR_DATA(values, et);
+   long n = offsets->size[0] - 1;
+   size_t size = proto_size_list_begin(protocol, n);
+   for (long i = 0; i < n; i++) {
+      long len = OFFSET(offsets, i + 1) - OFFSET(offsets, i);
+      size += proto_size_list_begin(protocol, len);
+      size += proto_size_array(protocol, et, data + OFFSET(offsets, i) * TENSOR_STRIDE(values) * array_width(et), len, TENSOR_STRIDE(values));
+   }
+   return size;
+}
+
+static int thrift_write_ragged(buffer_t *out, desc_t *desc, THByteTensor *values, THLongTensor *offsets) {
+   uint8_t et = desc->shape_ttype;
+   const uint8_t *data = TENSOR_DATA(values, et);
+   long n = offsets->size[0] - 1;
+   CTRY(proto_write_list_begin(out, desc->value_ttype->ttype, n))
+   for (long i = 0; i < n; i++) {
+      long len = OFFSET(offsets, i + 1) - OFFSET(offsets, i);
+      CTRY(proto_write_list_begin(out, et, len))
+      CTRY(proto_write_array(out, et, data + OFFSET(offsets, i) * TENSOR_STRIDE(values) * array_width(et), len, TENSOR_STRIDE(values)))
+   }
+   return 0;
+}
+
+// Converts the integer value at index to the type described by desc,
+// raising the usual range errors.
+static int64_t thrift_to_integer(lua_State *L, int index, desc_t *desc, int flags) {
    switch (desc->ttype) {
-      case TTYPE_BOOL: {
-         uint8_t i8;
-         i8 = lua_toboolean(L, index);
-         WRITE(L, &i8, sizeof(i8), out)
+      case TTYPE_BYTE: {
+         double d = lua_tonumber(L, index);
+         uint8_t i8 = d;
+         if ((double)i8 != d) return LUA_HANDLE_ERROR_STR(L, "byte value out of range");
+         return i8;
+      }
+      case TTYPE_I16: {
+         double d = lua_tonumber(L, index);
+         int16_t i16 = d;
+         if ((double)i16 != d) return LUA_HANDLE_ERROR_STR(L, "i16 value out of range");
+         return i16;
+      }
+      case TTYPE_I32:
+      case TTYPE_ENUM: {
+         double d = lua_tonumber(L, index);
+         int32_t i32 = d;
+         if ((double)i32 != d) return LUA_HANDLE_ERROR_STR(L, "i32 value out of range");
+         return i32;
+      }
+   }
+   int64_t i64;
+   switch (flags & I64_AS_MASK) {
+      case I64_AS_NUMBER: {
+         double d = lua_tonumber(L, index);
+         i64 = d;
+         if ((double)i64 != d) return LUA_HANDLE_ERROR_STR(L, "i64 value out of range");
+         return i64;
+      }
+      case I64_AS_STRING: {
+         size_t len;
+         const char *str = lua_tolstring(L, index, &len);
+         if (str == NULL || len == 0) return LUA_HANDLE_ERROR_STR(L, "i64 can not convert from empty string");
+         char *str_end = (char *)str + len;
+         errno = 0;  // reset errno, strtoll doesn't have a proper return code to indicate true error
+         i64 = strtoll(str, &str_end, 10);
+         if (i64 == 0 && errno == EINVAL) return LUA_HANDLE_ERROR(L, errno);
+         if ((i64 == LLONG_MIN || i64 == LLONG_MAX) && errno == ERANGE) return LUA_HANDLE_ERROR(L, errno);
+         if (str_end != ((char *)str + len)) return LUA_HANDLE_ERROR_STR(L, "i64 did not consume the entire string");
+         return i64;
+      }
+      case I64_AS_TENSOR: {
+         THLongTensor *values = luaT_toudata(L, index, "torch.LongTensor");
+         return values->storage->data[values->storageOffset];
+      }
+      default:
+         return LUA_HANDLE_ERROR_STR(L, "unknown flags value");
+   }
+}
+
+// The bytes of a string value, which may also be given as a ByteTensor.
+static const uint8_t *thrift_to_bytes(lua_State *L, int index, size_t *len) {
+   THByteTensor *tensor = luaT_toudata(L, index, "torch.ByteTensor");
+   if (tensor == NULL) return (const uint8_t *)lua_tolstring(L, index, len);
+   if (tensor->nDimension == 0) return (const uint8_t *)"";
+   if (tensor->nDimension != 1 || tensor->stride[0] != 1) {
+      LUA_HANDLE_ERROR_STR(L, "expected a contiguous 1 dimensional tensor");
+      return NULL;
+   }
+   *len = tensor->size[0];
+   return tensor->storage->data + tensor->storageOffset;
+}
+
+// Computes the exact number of bytes thrift_write_rcsv will produce for the
+// value at index, so the encoder can write once into a buffer of final size.
+static int thrift_size_rcsv(lua_State *L, int index, desc_t *desc, int flags, uint8_t protocol, size_t *size) {
+   // fixed width values were sized when the schema was compiled
+   if (desc->fixed_size) {
+      *size += desc->fixed_size;
+      return 0;
+   }
+   switch (desc->ttype) {
+      case TTYPE_BOOL:
+      case TTYPE_DOUBLE:
+         *size += proto_size_scalar(protocol, desc->ttype, 0);
+         return 0;
+      case TTYPE_BYTE:
+      case TTYPE_I16:
+      case TTYPE_I32:
+      case TTYPE_ENUM:
+      case TTYPE_I64:
+         *size += proto_size_scalar(protocol, desc->ttype, thrift_to_integer(L, index, desc, flags));
+         return 0;
+      case TTYPE_STRING: {
+         size_t len = 0;
+         thrift_to_bytes(L, index, &len);
+         *size += proto_size_binary(protocol, len);
          return 0;
       }
-      case TTYPE_BYTE: {
-         uint8_t i8;
-         if (in) {
-            memcpy(&i8, in, sizeof(i8));
-         } else {
-            double d = lua_tonumber(L, index);
-            i8 = d;
-            if ((double)i8 != d) return LUA_HANDLE_ERROR_STR(L, "byte value out of range");
+      case TTYPE_STRUCT: {
+         int16_t last_fid = 0;
+         for (int16_t j = 0; j < desc->num_fields; j++) {
+            thrift_get_field(L, index, &desc->fields[j]);
+            if (lua_type(L, -1) != LUA_TNIL) {
+               *size += proto_size_field_begin(protocol, desc->fields[j].field_id, &last_fid);
+               // compact bool fields carry their value in the field header
+               if (protocol == PROTOCOL_BINARY || desc->fields[j].ttype != TTYPE_BOOL) {
+                  thrift_size_rcsv(L, lua_gettop(L), &desc->fields[j], flags, protocol, size);
+               }
+            }
+            lua_pop(L, 1);
          }
-         WRITE(L, &i8, sizeof(i8), out)
+         *size += sizeof(uint8_t);
          return 0;
       }
-      case TTYPE_DOUBLE: {
-         int64_t i64;
-         if (in) {
-            memcpy(&i64, in, sizeof(i64));
-         } else {
-            double d = lua_tonumber(L, index);
-            memcpy(&i64, &d, sizeof(i64));
+      case TTYPE_MAP: {
+         THByteTensor *keys, *values;
+         if (thrift_map_tensors(L, index, desc, flags, &keys, &values)) {
+            uint8_t kt = desc->key_ttype->ttype, vt = desc->value_ttype->ttype;
+            *size += proto_size_map_begin(protocol, TENSOR_SIZE(keys));
+            *size += proto_size_array(protocol, kt, TENSOR_DATA(keys, kt), TENSOR_SIZE(keys), TENSOR_STRIDE(keys));
+            *size += proto_size_array(protocol, vt, TENSOR_DATA(values, vt), TENSOR_SIZE(values), TENSOR_STRIDE(values));
+            return 0;
+         }
+         int32_t count = 0;
+         int top = lua_gettop(L);
+         lua_pushnil(L);
+         while (lua_next(L, index) != 0) {
+            thrift_size_rcsv(L, top + 1, desc->key_ttype, flags, protocol, size);
+            thrift_size_rcsv(L, top + 2, desc->value_ttype, flags, protocol, size);
+            lua_pop(L, 1);
+            count++;
          }
-         i64 = htobe64(i64);
-         WRITE(L, &i64, sizeof(i64), out)
+         *size += proto_size_map_begin(protocol, count);
          return 0;
       }
-      case TTYPE_I16: {
-         int16_t i16;
-         if (in) {
-            memcpy(&i16, in, sizeof(i16));
-         } else {
-            double d = lua_tonumber(L, index);
-            i16 = d;
-            if ((double)i16 != d) return LUA_HANDLE_ERROR_STR(L, "i16 value out of range");
+      case TTYPE_SET:
+      case TTYPE_LIST: {
+         uint8_t vt = desc->value_ttype->ttype;
+         THByteTensor *values;
+         THLongTensor *offsets;
+         tensor_view_t *views;
+         long n;
+         if (desc->shape == SHAPE_COLUMNS && (n = thrift_struct_columns_views(L, index, desc, &views)) >= 0) {
+            *size += thrift_size_struct_columns(protocol, desc, views, n);
+            lua_pop(L, 1);
+            return 0;
+         }
+         if (desc->shape && thrift_shaped_tensors(L, index, desc, &values, &offsets)) {
+            if (desc->shape == SHAPE_FIXED) *size += thrift_size_fixed(protocol, desc, values, 0, TENSOR_DATA(values, desc->shape_ttype), array_width(desc->shape_ttype));
+            else *size += thrift_size_ragged(protocol, desc, values, offsets);
+            return 0;
+         }
+         if ((flags & LIST_AND_SET_AS_TENSOR) && (values = thrift_list_tensor(L, index, vt))) {
+            *size += proto_size_list_begin(protocol, TENSOR_SIZE(values));
+            *size += proto_size_array(protocol, vt, TENSOR_DATA(values, vt), TENSOR_SIZE(values), TENSOR_STRIDE(values));
+            return 0;
+         }
+         size_t len = lua_objlen(L, index);
+         *size += proto_size_list_begin(protocol, len);
+         int top = lua_gettop(L);
+         for (int32_t i = 1; i <= (int32_t)len; i++) {
+            lua_rawgeti(L, index, i);
+            thrift_size_rcsv(L, top + 1, desc->value_ttype, flags, protocol, size);
+            lua_pop(L, 1);
          }
-         i16 = htobe16(i16);
-         WRITE(L, &i16, sizeof(i16), out)
          return 0;
       }
+   }
+   return LUA_HANDLE_ERROR(L, EINVAL);
+}
+
+static int thrift_write_rcsv(lua_State *L, int index, desc_t *desc, buffer_t *out, int flags);
+
+static int thrift_write_value(lua_State *L, int index, desc_t *desc, buffer_t *out, int flags) {
+   switch (desc->ttype) {
+      case TTYPE_BOOL:
+         TRY(L, proto_write_bool(out, lua_toboolean(L, index)))
+         return 0;
+      case TTYPE_BYTE:
+         TRY(L, proto_write_byte(out, thrift_to_integer(L, index, desc, flags)))
+         return 0;
+      case TTYPE_DOUBLE:
+         TRY(L, proto_write_double(out, lua_tonumber(L, index)))
+         return 0;
+      case TTYPE_I16:
+         TRY(L, proto_write_i16(out, thrift_to_integer(L, index, desc, flags)))
+         return 0;
       case TTYPE_I32:
-      case TTYPE_ENUM: {
-         int32_t i32;
-         if (in) {
-            memcpy(&i32, in, sizeof(i32));
-         } else {
-            double d = lua_tonumber(L, index);
-            i32 = d;
-            if ((double)i32 != d) return LUA_HANDLE_ERROR_STR(L, "i32 value out of range");
-         }
-         i32 = htobe32(i32);
-         WRITE(L, &i32, sizeof(i32), out)
+      case TTYPE_ENUM:
+         TRY(L, proto_write_i32(out, thrift_to_integer(L, index, desc, flags)))
          return 0;
-      }
-      case TTYPE_I64: {
-         int64_t i64;
-         if (in) {
-            memcpy(&i64, in, sizeof(i64));
-         } else {
-            switch (flags & I64_AS_MASK) {
-               case I64_AS_NUMBER: {
-                  double d = lua_tonumber(L, index);
-                  i64 = d;
-                  if ((double)i64 != d) return LUA_HANDLE_ERROR_STR(L, "i64 value out of range");
-                  break;
-               }
-               case I64_AS_STRING: {
-                  size_t len;
-                  const char *str = lua_tolstring(L, index, &len);
-                  if (str == NULL || len == 0) return LUA_HANDLE_ERROR_STR(L, "i64 can not convert from empty string");
-                  char *str_end = (char *)str + len;
-                  errno = 0;  // reset errno, strtoll doesn't have a proper return code to indicate true error
-                  i64 = strtoll(str, &str_end, 10);
-                  if (i64 == 0 && errno == EINVAL) return LUA_HANDLE_ERROR(L, errno);
-                  if ((i64 == LLONG_MIN || i64 == LLONG_MAX) && errno == ERANGE) return LUA_HANDLE_ERROR(L, errno);
-                  if (str_end != ((char *)str + len)) return LUA_HANDLE_ERROR_STR(L, "i64 did not consume the entire string");
-                  break;
-               }
-               case I64_AS_TENSOR: {
-                  THLongTensor *values = luaT_toudata(L, index, "torch.LongTensor");
-                  i64 = values->storage->data[values->storageOffset];
-                  break;
-               }
-               default:
-                  return LUA_HANDLE_ERROR_STR(L, "unknown flags value");
-            }
-         }
-         i64 = htobe64(i64);
-         WRITE(L, &i64, sizeof(i64), out)
+      case TTYPE_I64:
+         TRY(L, proto_write_i64(out, thrift_to_integer(L, index, desc, flags)))
          return 0;
-      }
       case TTYPE_STRING: {
-         size_t len;
-         const char *str = lua_tolstring(L, index, &len);
-         int32_t i32 = htobe32(len);
-         WRITE(L, &i32, sizeof(i32), out)
-         WRITE(L, str, len, out)
+         size_t len = 0;
+         const uint8_t *str = thrift_to_bytes(L, index, &len);
+         TRY(L, proto_write_binary(out, str, len))
          return 0;
       }
       case TTYPE_STRUCT: {
+         int16_t last_fid = 0;
          for (int16_t j = 0; j < desc->num_fields; j++) {
-            if (desc->fields[j].field_name) {
-               lua_pushstring(L, desc->fields[j].field_name);
-            } else {
-               lua_pushinteger(L, desc->fields[j].field_id);
-            }
-            lua_rawget(L, index);
+            thrift_get_field(L, index, &desc->fields[j]);
             if (lua_type(L, -1) != LUA_TNIL) {
-               WRITE(L, &desc->fields[j].ttype, sizeof(uint8_t), out)
-               int16_t i16 = htobe16(desc->fields[j].field_id);
-               WRITE(L, &i16, sizeof(i16), out)
-               thrift_write_rcsv(L, lua_gettop(L), &desc->fields[j], out, flags, NULL);
+               TRY(L, proto_write_field_begin(out, desc->fields[j].ttype, desc->fields[j].field_id, &last_fid, lua_toboolean(L, -1)))
+               thrift_write_rcsv(L, lua_gettop(L), &desc->fields[j], out, flags);
             }
             lua_pop(L, 1);
          }
-         uint8_t i8 = TTYPE_STOP;
-         WRITE(L, &i8, sizeof(i8), out)
+         TRY(L, proto_write_field_stop(out))
          return 0;
       }
       case TTYPE_MAP: {
-         WRITE(L, &desc->key_ttype->ttype, sizeof(uint8_t), out)
-         WRITE(L, &desc->value_ttype->ttype, sizeof(uint8_t), out)
+         THByteTensor *keys, *values;
+         if (thrift_map_tensors(L, index, desc, flags, &keys, &values)) {
+            uint8_t kt = desc->key_ttype->ttype, vt = desc->value_ttype->ttype;
+            TRY(L, proto_write_map_begin(out, kt, vt, TENSOR_SIZE(keys)))
+            TRY(L, proto_write_pairs(out, kt, TENSOR_DATA(keys, kt), TENSOR_STRIDE(keys), vt, TENSOR_DATA(values, vt), TENSOR_STRIDE(values), TENSOR_SIZE(keys)))
+            return 0;
+         }
          int32_t i32 = 0;
          lua_pushnil(L);
          while (lua_next(L, index) != 0) {
             i32++;
             lua_pop(L, 1);
          }
-         i32 = htobe32(i32);
-         WRITE(L, &i32, sizeof(i32), out)
+         TRY(L, proto_write_map_begin(out, desc->key_ttype->ttype, desc->value_ttype->ttype, i32))
          int top = lua_gettop(L);
          lua_pushnil(L);
          while (lua_next(L, index) != 0) {
-            thrift_write_rcsv(L, top + 1, desc->key_ttype, out, flags, NULL);
-            thrift_write_rcsv(L, top + 2, desc->value_ttype, out, flags, NULL);
+            thrift_write_rcsv(L, top + 1, desc->key_ttype, out, flags);
+            thrift_write_rcsv(L, top + 2, desc->value_ttype, out, flags);
             lua_pop(L, 1);
          }
          return 0;
       }
       case TTYPE_SET:
       case TTYPE_LIST: {
-         WRITE(L, &desc->value_ttype->ttype, sizeof(uint8_t), out)
-         if (flags & LIST_AND_SET_AS_TENSOR) {
-            switch (desc->value_ttype->ttype) {
-               case TTYPE_BYTE: {
-                  THByteTensor *values = luaT_toudata(L, index, "torch.ByteTensor");
-                  if (values->nDimension != 1) return LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional tensor");
-                  int32_t len = values->size[0];
-                  int32_t i32 = htobe32(len);
-                  WRITE(L, &i32, sizeof(i32), out)
-                  for (int32_t i = 0; i < len; i++) {
-                     thrift_write_rcsv(L, -1, desc->value_ttype, out, flags, values->storage->data + values->storageOffset + i);
-                  }
-                  return 0;
-               }
-               case TTYPE_DOUBLE: {
-                  THDoubleTensor *values = luaT_toudata(L, index, "torch.DoubleTensor");
-                  if (values->nDimension != 1) return LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional tensor");
-                  int32_t len = values->size[0];
-                  int32_t i32 = htobe32(len);
-                  WRITE(L, &i32, sizeof(i32), out)
-                  for (int32_t i = 0; i < len; i++) {
-                     thrift_write_rcsv(L, -1, desc->value_ttype, out, flags, values->storage->data + values->storageOffset + i);
-                  }
-                  return 0;
-               }
-               case TTYPE_I16: {
-                  THShortTensor *values = luaT_toudata(L, index, "torch.ShortTensor");
-                  if (values->nDimension != 1) return LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional tensor");
-                  int32_t len = values->size[0];
-                  int32_t i32 = htobe32(len);
-                  WRITE(L, &i32, sizeof(i32), out)
-                  for (int32_t i = 0; i < len; i++) {
-                     thrift_write_rcsv(L, -1, desc->value_ttype, out, flags, values->storage->data + values->storageOffset + i);
-                  }
-                  return 0;
-               }
-               case TTYPE_I32: {
-                  THIntTensor *values = luaT_toudata(L, index, "torch.IntTensor");
-                  if (values->nDimension != 1) return LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional tensor");
-                  int32_t len = values->size[0];
-                  int32_t i32 = htobe32(len);
-                  WRITE(L, &i32, sizeof(i32), out)
-                  for (int32_t i = 0; i < len; i++) {
-                     thrift_write_rcsv(L, -1, desc->value_ttype, out, flags, values->storage->data + values->storageOffset + i);
-                  }
-                  return 0;
-               }
-               case TTYPE_I64: {
-                  THLongTensor *values = luaT_toudata(L, index, "torch.LongTensor");
-                  if (values->nDimension != 1) return LUA_HANDLE_ERROR_STR(L, "expected a 1 dimensional tensor");
-                  int32_t len = values->size[0];
-                  int32_t i32 = htobe32(len);
-                  WRITE(L, &i32, sizeof(i32), out)
-                  for (int32_t i = 0; i < len; i++) {
-                     thrift_write_rcsv(L, -1, desc->value_ttype, out, flags, values->storage->data + values->storageOffset + i);
-                  }
-                  return 0;
-               }
-            }
+         uint8_t vt = desc->value_ttype->ttype;
+         THByteTensor *values;
+         THLongTensor *offsets;
+         tensor_view_t *views;
+         long n;
+         if (desc->shape == SHAPE_COLUMNS && (n = thrift_struct_columns_views(L, index, desc, &views)) >= 0) {
+            TRY(L, thrift_write_struct_columns(out, desc, views, n))
+            lua_pop(L, 1);
+            return 0;
+         }
+         if (desc->shape && thrift_shaped_tensors(L, index, desc, &values, &offsets)) {
+            if (desc->shape == SHAPE_FIXED) TRY(L, thrift_write_fixed(out, desc, values, 0, TENSOR_DATA(values, desc->shape_ttype), array_width(desc->shape_ttype)))
+            else TRY(L, thrift_write_ragged(out, desc, values, offsets))
+            return 0;
+         }
+         if ((flags & LIST_AND_SET_AS_TENSOR) && (values = thrift_list_tensor(L, index, vt))) {
+            TRY(L, proto_write_list_begin(out, vt, TENSOR_SIZE(values)))
+            TRY(L, proto_write_array(out, vt, TENSOR_DATA(values, vt), TENSOR_SIZE(values), TENSOR_STRIDE(values)))
+            return 0;
          }
          size_t len = lua_objlen(L, index);
-         int32_t i32 = htobe32(len);
-         WRITE(L, &i32, sizeof(i32), out)
+         TRY(L, proto_write_list_begin(out, vt, len))
          int top = lua_gettop(L);
          for (int32_t i = 1; i <= (int32_t)len; i++) {
             lua_rawgeti(L, index, i);
-            thrift_write_rcsv(L, top + 1, desc->value_ttype, out, flags, NULL);
+            thrift_write_rcsv(L, top + 1, desc->value_ttype, out, flags);
             lua_pop(L, 1);
          }
          return 0;
@@ -690,42 +3356,417 @@ static int thrift_write_rcsv(lua_State *L, int index, desc_t *desc, buffer_t *ou
    return LUA_HANDLE_ERROR(L, EINVAL);
 }
 
+// Writes a value, counting it when the codec keeps stats.
+static int thrift_write_rcsv(lua_State *L, int index, desc_t *desc, buffer_t *out, int flags) {
+   if (!(flags & STATS)) return thrift_write_value(L, index, desc, out, flags);
+   size_t start = out->cb;
+   uint64_t t0 = thrift_clock_ns();
+   thrift_write_value(L, index, desc, out, flags);
+   thrift_stats_value(desc->stats, desc->ttype, desc, out->cb - start, t0);
+   return 0;
+}
+
 static int thrift_write(lua_State *L) {
    desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   uint8_t protocol = THRIFT_PROTOCOL(desc->flags);
+   size_t size = 0;
+   thrift_size_rcsv(L, 2, desc, desc->flags, protocol, &size);
    buffer_t out;
    memset(&out, 0, sizeof(buffer_t));
-   thrift_write_rcsv(L, 2, desc, &out, desc->flags, NULL);
+   out.max_cb = size;
+   out.fixed = 1;
+   out.protocol = protocol;
+#if LUA_VERSION_NUM >= 502
+   luaL_Buffer b;
+   out.data = (uint8_t *)luaL_buffinitsize(L, &b, size);
+   thrift_write_rcsv(L, 2, desc, &out, desc->flags);
+   thrift_stats_record(desc, out.cb, 1, 1);
+   luaL_pushresultsize(&b, out.cb);
+#else
+   // Lua 5.1 has no way to fill a string in place, so encode into a
+   // collectable block of the final size and copy it once.
+   out.data = (uint8_t *)lua_newuserdata(L, MAX(size, 1));
+   thrift_write_rcsv(L, 2, desc, &out, desc->flags);
+   thrift_stats_record(desc, out.cb, 1, 1);
    lua_pushlstring(L, (const char *)out.data, out.cb);
-   free(out.data);
+#endif
    return 1;
 }
 
 static int thrift_write_tensor(lua_State *L) {
    desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   uint8_t protocol = THRIFT_PROTOCOL(desc->flags);
+   size_t size = 0;
+   thrift_size_rcsv(L, 2, desc, desc->flags, protocol, &size);
+   THByteStorage* storage = THByteStorage_newWithSize(size);
+   THByteTensor *tensor = THByteTensor_newWithStorage1d(storage, 0, size, 1);
+   THByteStorage_free(storage);
+   luaT_pushudata(L, tensor, "torch.ByteTensor");
+   buffer_t out;
+   memset(&out, 0, sizeof(buffer_t));
+   out.data = storage->data;
+   out.max_cb = size;
+   out.fixed = 1;
+   out.protocol = protocol;
+   thrift_write_rcsv(L, 2, desc, &out, desc->flags);
+   thrift_stats_record(desc, out.cb, 1, 1);
+   return 1;
+}
+
+// Writes the encoding of a value into a ByteTensor at the given byte offset,
+// optionally preceded by its big-endian i32 length, and returns the offset
+// one past it. The tensor at least doubles whenever it has to grow, so
+// batches of records can share one buffer.
+static int thrift_write_into(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   uint8_t protocol = THRIFT_PROTOCOL(desc->flags);
+   THByteTensor *tensor = luaT_checkudata(L, 2, "torch.ByteTensor");
+   lua_Integer offset = luaL_optinteger(L, 3, 0);
+   int framed = lua_toboolean(L, 5);
+   if (tensor->nDimension > 1 || (tensor->nDimension == 1 && tensor->stride[0] != 1)) return LUA_HANDLE_ERROR_STR(L, "expected a contiguous 1 dimensional tensor");
+   long capacity = tensor->nDimension ? tensor->size[0] : 0;
+   if (offset < 0 || offset > capacity) return LUA_HANDLE_ERROR_STR(L, "offset out of range");
+   size_t size = 0;
+   thrift_size_rcsv(L, 4, desc, desc->flags, protocol, &size);
+   if (framed && size > INT32_MAX) return LUA_HANDLE_ERROR(L, ERANGE);
+   size_t needed = offset + (framed ? sizeof(int32_t) : 0) + size;
+   int grown = needed > (size_t)capacity;
+   if (grown) {
+      THByteTensor_resize1d(tensor, MAX(needed, 2 * (size_t)capacity));
+   }
+   buffer_t out;
+   memset(&out, 0, sizeof(buffer_t));
+   out.data = THByteTensor_data(tensor) + offset;
+   out.max_cb = needed - offset;
+   out.fixed = 1;
+   out.protocol = protocol;
+   if (framed) {
+      int32_t i32 = htobe32((int32_t)size);
+      memcpy(out.data, &i32, sizeof(i32));
+      out.cb = sizeof(i32);
+   }
+   thrift_write_rcsv(L, 4, desc, &out, desc->flags);
+   thrift_stats_record(desc, out.cb, 1, grown);
+   lua_pushinteger(L, offset + out.cb);
+   return 1;
+}
+
+// Block writers encode records into the current block and compress and
+// append it to the file once it reaches the block size. Closing writes the
+// last block and the index.
+typedef struct block_writer_t {
+   desc_t *desc;
+   FILE *fp;
+   int compression;
+   int level;
+   size_t block_size;
+   buffer_t block;
+   size_t committed;
+   uint32_t records;
+   uint8_t *scratch;
+   size_t max_scratch;
+   uint64_t offset;
+   uint8_t *index;
+   size_t num_blocks;
+   size_t max_blocks;
+   int closed;
+} block_writer_t;
+
+static block_writer_t *thrift_block_writer_check(lua_State *L, int index) {
+   block_writer_t *writer = (block_writer_t *)luaL_checkudata(L, index, "thrift.blockwriter");
+   if (writer->closed) LUA_HANDLE_ERROR_STR(L, "writer is closed");
+   return writer;
+}
+
+static int thrift_block_flush(block_writer_t *writer) {
+   if (writer->records == 0) return 0;
+   size_t bound = BLOCK_FRAME_SIZE + block_bound(writer->compression, writer->committed);
+   if (bound > writer->max_scratch) {
+      uint8_t *scratch = (uint8_t *)realloc(writer->scratch, bound);
+      if (scratch == NULL) return -ENOMEM;
+      writer->scratch = scratch;
+      writer->max_scratch = bound;
+   }
+   if (writer->num_blocks == writer->max_blocks) {
+      size_t max_blocks = MAX(writer->max_blocks * 2, 64);
+      uint8_t *index = (uint8_t *)realloc(writer->index, max_blocks * BLOCK_INDEX_SIZE);
+      if (index == NULL) return -ENOMEM;
+      writer->index = index;
+      writer->max_blocks = max_blocks;
+   }
+   size_t size;
+   CTRY(block_compress(writer->compression, writer->level, writer->block.data, writer->committed, writer->scratch + BLOCK_FRAME_SIZE, &size))
+   block_put_u32(writer->scratch, size);
+   block_put_u32(writer->scratch + 4, writer->committed);
+   block_put_u32(writer->scratch + 8, writer->records);
+   if (fwrite(writer->scratch, 1, BLOCK_FRAME_SIZE + size, writer->fp) != BLOCK_FRAME_SIZE + size) return -EIO;
+   uint8_t *entry = writer->index + writer->num_blocks++ * BLOCK_INDEX_SIZE;
+   block_put_u64(entry, writer->offset);
+   block_put_u32(entry + 8, writer->records);
+   writer->offset += BLOCK_FRAME_SIZE + size;
+   writer->block.cb = writer->committed = 0;
+   writer->records = 0;
+   return 0;
+}
+
+// Writes the last block, the index and the footer, and releases the writer
+// whether that worked or not.
+static int thrift_block_finish(block_writer_t *writer) {
+   if (writer->closed) return 0;
+   int ret = thrift_block_flush(writer);
+   if (ret == 0 && writer->num_blocks && fwrite(writer->index, BLOCK_INDEX_SIZE, writer->num_blocks, writer->fp) != writer->num_blocks) ret = -EIO;
+   if (ret == 0) {
+      uint8_t footer[BLOCK_FOOTER_SIZE];
+      block_put_u64(footer, writer->offset);
+      block_put_u32(footer + 8, writer->num_blocks);
+      block_put_u32(footer + 12, BLOCK_MAGIC);
+      if (fwrite(footer, 1, sizeof(footer), writer->fp) != sizeof(footer)) ret = -EIO;
+   }
+   if (fclose(writer->fp) != 0 && ret == 0) ret = -errno;
+   free(writer->block.data);
+   free(writer->scratch);
+   free(writer->index);
+   writer->closed = 1;
+   return ret;
+}
+
+// Appends a record to the current block, which is compressed and written
+// once it holds at least the block size.
+static int thrift_block_writer_write(lua_State *L) {
+   block_writer_t *writer = thrift_block_writer_check(L, 1);
+   desc_t *desc = writer->desc;
+   // a record that failed to encode leaves nothing behind
+   writer->block.cb = writer->committed;
+   size_t size = 0;
+   thrift_size_rcsv(L, 2, desc, desc->flags, writer->block.protocol, &size);
+   if (size > INT32_MAX || writer->committed + sizeof(int32_t) + size > UINT32_MAX) return LUA_HANDLE_ERROR(L, ERANGE);
+   TRY(L, buffer_reserve(&writer->block, sizeof(int32_t) + size))
+   int32_t i32 = htobe32((int32_t)size);
+   memcpy(writer->block.data + writer->block.cb, &i32, sizeof(i32));
+   writer->block.cb += sizeof(i32);
+   thrift_write_rcsv(L, 2, desc, &writer->block, desc->flags);
+   thrift_stats_record(desc, writer->block.cb - writer->committed, 1, 0);
+   writer->committed = writer->block.cb;
+   writer->records++;
+   if (writer->committed >= writer->block_size) TRY(L, thrift_block_flush(writer))
+   return 0;
+}
+
+static int thrift_block_writer_close(lua_State *L) {
+   block_writer_t *writer = (block_writer_t *)luaL_checkudata(L, 1, "thrift.blockwriter");
+   TRY(L, thrift_block_finish(writer))
+   return 0;
+}
+
+// Creates a block file and returns a writer for it. Options are the
+// compression, "zlib" unless given, its level and the uncompressed size
+// blocks are cut at.
+static int thrift_open_block_writer(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   const char *path = luaL_checkstring(L, 2);
+   int compression = BLOCK_ZLIB;
+   lua_Integer level = 0, block_size = 1 << 20;
+   if (lua_type(L, 3) == LUA_TTABLE) {
+      lua_getfield(L, 3, "compression");
+      if (!lua_isnil(L, -1)) {
+         compression = block_compression(luaL_checkstring(L, -1));
+         if (compression == -ENOTSUP) return LUA_HANDLE_ERROR_STR(L, "compression not included in this build");
+         if (compression < 0) return LUA_HANDLE_ERROR_STR(L, "unknown compression");
+      }
+      lua_getfield(L, 3, "level");
+      level = luaL_optinteger(L, -1, 0);
+      lua_getfield(L, 3, "blockSize");
+      block_size = luaL_optinteger(L, -1, block_size);
+      lua_pop(L, 3);
+   }
+   if (block_size < 1 || block_size > INT32_MAX) return LUA_HANDLE_ERROR_STR(L, "block size out of range");
+   block_writer_t *writer = (block_writer_t *)lua_newuserdata(L, sizeof(block_writer_t));
+   memset(writer, 0, sizeof(block_writer_t));
+   writer->desc = desc;
+   writer->compression = compression;
+   writer->level = level;
+   writer->block_size = block_size;
+   writer->block.protocol = THRIFT_PROTOCOL(desc->flags);
+   writer->closed = 1;
+   luaL_getmetatable(L, "thrift.blockwriter");
+   lua_setmetatable(L, -2);
+   // the writer keeps its codec alive
+   lua_createtable(L, 1, 0);
+   lua_pushvalue(L, 1);
+   lua_rawseti(L, -2, 1);
+   lua_setuservalue(L, -2);
+   writer->fp = fopen(path, "wb");
+   if (writer->fp == NULL) return LUA_HANDLE_ERROR(L, errno);
+   writer->closed = 0;
+   uint8_t header[BLOCK_HEADER_SIZE] = { 0 };
+   block_put_u32(header, BLOCK_MAGIC);
+   header[4] = BLOCK_VERSION;
+   header[5] = compression;
+   if (fwrite(header, 1, sizeof(header), writer->fp) != sizeof(header)) return LUA_HANDLE_ERROR(L, EIO);
+   writer->offset = sizeof(header);
+   return 1;
+}
+
+// Collecting an open writer still finishes its file, as well as it can.
+static int thrift_block_writer_gc(lua_State *L) {
+   block_writer_t *writer = (block_writer_t *)lua_touserdata(L, 1);
+   thrift_block_finish(writer);
+   return 0;
+}
+
+static const luaL_Reg thrift_block_writer_routines[] = {
+   {"write", thrift_block_writer_write},
+   {"close", thrift_block_writer_close},
+   {"__gc", thrift_block_writer_gc},
+   {NULL, NULL}
+};
+
+// Re-encodes a serialized value from the codec's protocol into the other
+// one. Strings produce strings and ByteTensors produce ByteTensors.
+static int thrift_transcode(lua_State *L) {
+   desc_t *desc = (desc_t *)lua_touserdata(L, 1);
+   buffer_t in;
+   int is_string = thrift_source_buffer(L, 2, &in);
+   in.protocol = THRIFT_PROTOCOL(desc->flags);
    buffer_t out;
    memset(&out, 0, sizeof(buffer_t));
-   thrift_write_rcsv(L, 2, desc, &out, desc->flags, NULL);
-   THByteStorage* storage = THByteStorage_newWithSize(out.cb);
-   memcpy(storage->data, out.data, out.cb);
+   out.protocol = in.protocol == PROTOCOL_BINARY ? PROTOCOL_COMPACT : PROTOCOL_BINARY;
+   int ret = proto_transcode(&in, &out, desc->ttype, 0);
+   if (ret) {
+      free(out.data);
+      return LUA_HANDLE_ERROR(L, ret);
+   }
+   if (is_string) {
+      lua_pushlstring(L, (const char *)out.data, out.cb);
+   } else {
+      THByteTensor *tensor = THByteTensor_newWithSize1d(out.cb);
+      memcpy(THByteTensor_data(tensor), out.data, out.cb);
+      luaT_pushudata(L, tensor, "torch.ByteTensor");
+   }
    free(out.data);
-   THLongStorage *size = THLongStorage_newWithSize(1);
-   size->data[0] = storage->size;
-   THByteTensor *tensor = THByteTensor_newWithStorage(storage, 0, size, NULL);
-   THLongStorage_free(size);
-   luaT_pushudata(L, tensor, "torch.ByteTensor");
    return 1;
 }
 
+static const char *thrift_ttype_name(uint8_t ttype) {
+   switch (ttype) {
+      case TTYPE_BOOL: return "bool";
+      case TTYPE_BYTE: return "byte";
+      case TTYPE_DOUBLE: return "double";
+      case TTYPE_I16: return "i16";
+      case TTYPE_I32: return "i32";
+      case TTYPE_I64: return "i64";
+      case TTYPE_STRING: return "string";
+      case TTYPE_STRUCT: return "struct";
+      case TTYPE_MAP: return "map";
+      case TTYPE_SET: return "set";
+      case TTYPE_LIST: return "list";
+      case TTYPE_ENUM: return "enum";
+      default: return "void";
+   }
+}
+
+static void thrift_push_value_stats(lua_State *L, value_stats_t *v) {
+   lua_createtable(L, 0, 3);
+   lua_pushnumber(L, v->count);
+   lua_setfield(L, -2, "count");
+   lua_pushnumber(L, v->bytes);
+   lua_setfield(L, -2, "bytes");
+   lua_pushnumber(L, v->ns / 1e9);
+   lua_setfield(L, -2, "seconds");
+}
+
+// Adds the counters of every field below desc to the table on top of the
+// stack, keyed by their dotted paths. Fields of structs inside containers
+// share the path of the container.
+static void thrift_push_field_stats(lua_State *L, stats_t *stats, desc_t *desc, char *path, size_t len, size_t max) {
+   for (uint16_t i = 0; i < desc->num_fields; i++) {
+      desc_t *field = &desc->fields[i];
+      int n = field->field_name ?
+         snprintf(path + len, max - len, "%s%s", len ? "." : "", field->field_name) :
+         snprintf(path + len, max - len, "%s%d", len ? "." : "", field->field_id);
+      if (n < 0 || (size_t)n >= max - len) continue;
+      value_stats_t *v = &stats->fields[field - stats->nodes];
+      if (v->count) {
+         thrift_push_value_stats(L, v);
+         lua_setfield(L, -2, path);
+      }
+      thrift_push_field_stats(L, stats, field, path, len + n, max);
+   }
+   path[len] = 0;
+   if (desc->key_ttype) thrift_push_field_stats(L, stats, desc->key_ttype, path, len, max);
+   if (desc->value_ttype) thrift_push_field_stats(L, stats, desc->value_ttype, path, len, max);
+}
+
+static stats_t *thrift_check_stats(lua_State *L) {
+   codec_t *codec = (codec_t *)lua_touserdata(L, 1);
+   if (codec->stats == NULL) LUA_HANDLE_ERROR_STR(L, "codec was created without the stats option");
+   return codec->stats;
+}
+
+static int thrift_stats(lua_State *L) {
+   codec_t *codec = (codec_t *)lua_touserdata(L, 1);
+   stats_t *stats = thrift_check_stats(L);
+   lua_createtable(L, 0, 7);
+   lua_pushnumber(L, stats->records_read);
+   lua_setfield(L, -2, "recordsRead");
+   lua_pushnumber(L, stats->records_written);
+   lua_setfield(L, -2, "recordsWritten");
+   lua_pushnumber(L, stats->bytes_read);
+   lua_setfield(L, -2, "bytesRead");
+   lua_pushnumber(L, stats->bytes_written);
+   lua_setfield(L, -2, "bytesWritten");
+   lua_pushnumber(L, stats->allocations);
+   lua_setfield(L, -2, "allocations");
+   lua_newtable(L);
+   for (uint8_t ttype = 0; ttype <= TTYPE_ENUM; ttype++) {
+      if (stats->ttypes[ttype].count) {
+         thrift_push_value_stats(L, &stats->ttypes[ttype]);
+         lua_setfield(L, -2, thrift_ttype_name(ttype));
+      }
+   }
+   lua_setfield(L, -2, "ttypes");
+   lua_newtable(L);
+   char path[1024];
+   path[0] = 0;
+   thrift_push_field_stats(L, stats, &codec->desc, path, 0, sizeof(path));
+   lua_setfield(L, -2, "fields");
+   return 1;
+}
+
+static int thrift_reset_stats(lua_State *L) {
+   stats_t *stats = thrift_check_stats(L);
+   memset(stats, 0, offsetof(stats_t, nodes));
+   memset(stats->fields, 0, stats->num_nodes * sizeof(value_stats_t));
+   return 0;
+}
+
 static const luaL_Reg thrift_routines[] = {
    {"codec", thrift_desc},
+   {"codecFromBlob", thrift_desc_from_blob},
    {NULL, NULL}
 };
 
 static const luaL_Reg thrift_codec_routines[] = {
    {"read", thrift_read},
+   {"readInto", thrift_read_into},
    {"readTensor", thrift_read_tensor},
+   {"readBatch", thrift_read_batch},
+   {"readColumns", thrift_read_columns},
+   {"readSparse", thrift_read_sparse},
+   {"index", thrift_index},
+   {"validate", thrift_validate},
+   {"readLazy", thrift_read_lazy},
+   {"get", thrift_get},
+   {"openFile", thrift_open_file},
+   {"openBlockFile", thrift_open_block_file},
+   {"openBlockWriter", thrift_open_block_writer},
    {"write", thrift_write},
    {"writeTensor", thrift_write_tensor},
+   {"writeInto", thrift_write_into},
+   {"transcode", thrift_transcode},
+   {"stats", thrift_stats},
+   {"resetStats", thrift_reset_stats},
+   {"serialize", thrift_serialize},
    {"__gc", thrift_gc},
    {NULL, NULL}
 };
@@ -736,6 +3777,27 @@ DLL_EXPORT int luaopen_libthrift(lua_State *L) {
    lua_pushvalue(L, -2);
    lua_settable(L, -3);
    luaT_setfuncs(L, thrift_codec_routines, 0);
+   luaL_newmetatable(L, "thrift.file");
+   lua_pushstring(L, "__index");
+   lua_pushvalue(L, -2);
+   lua_settable(L, -3);
+   luaT_setfuncs(L, thrift_file_routines, 0);
+   lua_pop(L, 1);
+   luaL_newmetatable(L, "thrift.blockfile");
+   lua_pushstring(L, "__index");
+   lua_pushvalue(L, -2);
+   lua_settable(L, -3);
+   luaT_setfuncs(L, thrift_block_file_routines, 0);
+   lua_pop(L, 1);
+   luaL_newmetatable(L, "thrift.blockwriter");
+   lua_pushstring(L, "__index");
+   lua_pushvalue(L, -2);
+   lua_settable(L, -3);
+   luaT_setfuncs(L, thrift_block_writer_routines, 0);
+   lua_pop(L, 1);
+   luaL_newmetatable(L, "thrift.lazy");
+   luaT_setfuncs(L, thrift_lazy_routines, 0);
+   lua_pop(L, 1);
    lua_newtable(L);
    luaT_setfuncs(L, thrift_routines, 0);
    return 1;
@@ -431,6 +431,36 @@ test {
       assert(result.a_map["x"].y == data.a_map["x"].y)
    end,
 
+   testFieldLookup = function()
+      -- dense ids use the direct table, sparse ids the binary search
+      for _,ids in ipairs({ { 1, 2, 3, 5, 8, 13 }, { 2, 700, 1000, 20000, 32767 } }) do
+         local fields = { }
+         local data = { }
+         for i,id in ipairs(ids) do
+            fields[id] = { ttype = "i32", name = "f"..id }
+            data["f"..id] = i * 11
+         end
+         local codec = thrift.codec({ ttype = "struct", fields = fields })
+         local result = codec:read(codec:write(data))
+         for _,id in ipairs(ids) do
+            assert(result["f"..id] == data["f"..id])
+         end
+         -- fields out of schema order, then an id the schema does not know
+         local i32 = { 8, 0, 0, 0, 0, 0, 7 }
+         i32[2] = math.floor(ids[#ids] / 256)
+         i32[3] = ids[#ids] % 256
+         local first = { 8, 0, ids[1], 0, 0, 0, 9 }
+         local bytes = { }
+         for _,b in ipairs(i32) do table.insert(bytes, b) end
+         for _,b in ipairs(first) do table.insert(bytes, b) end
+         table.insert(bytes, 0)
+         local out = codec:read(fromBytes(bytes))
+         assert(out["f"..ids[#ids]] == 7)
+         assert(out["f"..ids[1]] == 9)
+         fail(codec, 'unknown field', { 8, 0, 4, 0, 0, 0, 1, 0 })
+      end
+   end,
+
    testI64Tensors = function()
       local c = thrift.codec({ ttype = "i64", i64tensor = true })
       pass(c, torch.LongTensor({12345}))
@@ -453,6 +483,240 @@ test {
       end
    end,
 
+   testTensorsFromBinary = function()
+      -- big-endian two's complement bytes of an integer
+      local function be(v, n)
+         local bytes = { }
+         local neg = v < 0
+         if neg then v = -v - 1 end
+         for i = n,1,-1 do
+            bytes[i] = neg and (255 - v % 256) or (v % 256)
+            v = math.floor(v / 256)
+         end
+         return bytes
+      end
+      local widths = { byte = { 3, 1, "Byte" }, i16 = { 6, 2, "Short" }, i32 = { 8, 4, "Int" }, i64 = { 10, 8, "Long" } }
+      for inner,w in pairs(widths) do
+         -- odd sizes exercise both the vector loop and its scalar tail
+         for _,n in ipairs({ 1, 7, 33, 130 }) do
+            local expected = torch[w[3].."Tensor"](n)
+            local data = { w[1] }
+            for _,b in ipairs(be(n, 4)) do table.insert(data, b) end
+            for i = 1,n do
+               local v = (inner == "byte") and ((i * 7) % 256) or ((i * 7919) % 30000 - 15000)
+               expected[i] = v
+               for _,b in ipairs(be(v, w[2])) do table.insert(data, b) end
+            end
+            local c = thrift.codec({ ttype = "list", value = inner, tensors = true })
+            pass(c, expected, data)
+            table.remove(data)
+            fail(c, 'truncated', data)
+         end
+      end
+      local c = thrift.codec({ ttype = "list", value = "double", tensors = true })
+      pass(c, torch.DoubleTensor({ 1, -2.5 }), {
+         4, 0, 0, 0, 2,
+         0x3F, 0xF0, 0, 0, 0, 0, 0, 0,
+         0xC0, 0x04, 0, 0, 0, 0, 0, 0,
+      })
+   end,
+
+   testTensorsNonContiguous = function()
+      local inners = { byte = "Byte", double = "Double", i16 = "Short", i32 = "Int", i64 = "Long" }
+      for inner,tt in pairs(inners) do
+         local m = torch.Tensor(67, 3):random(0, 100):type("torch."..tt.."Tensor")
+         local c = thrift.codec({ ttype = "list", value = inner, tensors = true })
+         -- a column has stride 3, a narrowed row has an offset into the storage
+         pass(c, m:select(2, 2))
+         pass(c, m:select(1, 5))
+         pass(c, m:select(2, 3):narrow(1, 11, 40))
+      end
+   end,
+
+   testMapsAsTensors = function()
+      for _,protocol in ipairs({ "binary", "compact" }) do
+         local codec = thrift.codec({
+            ttype = 'struct',
+            mapsAsTensors = true,
+            protocol = protocol,
+            fields = {
+               [1] = { ttype = 'map', key = 'i64', value = 'double', name = 'features' },
+               [2] = { ttype = 'map', key = 'string', value = 'i32', name = 'names' },
+               [3] = { ttype = 'map', key = 'i32', value = 'i16', name = 'empty' },
+            },
+         })
+         local keys = torch.LongTensor({ 3, 1, 2 })
+         local values = torch.DoubleTensor({ 0.5, 1.5, -2 })
+         local x = codec:read(codec:write({
+            features = { keys = keys, values = values },
+            names = { a = 1 },
+            empty = { keys = torch.IntTensor(), values = torch.ShortTensor() },
+         }))
+         assert(torch.all(torch.eq(x.features.keys, keys)) and torch.all(torch.eq(x.features.values, values)))
+         assert(x.names.a == 1)
+         assert(x.empty.keys:nElement() == 0 and x.empty.values:nElement() == 0)
+         -- plain tables are still written as maps
+         x = codec:read(codec:write({ features = { [7] = 0.25 } }))
+         assert(x.features.keys[1] == 7 and x.features.values[1] == 0.25)
+         -- strided tensors
+         local both = torch.LongTensor({ { 1, 2 }, { 3, 4 } })
+         x = codec:read(codec:write({ features = { keys = both:select(2, 1), values = torch.DoubleTensor({ 1, 2 }) } }))
+         assert(x.features.keys[2] == 3)
+         assert(pcall(function() return codec:write({ features = { keys = keys, values = torch.DoubleTensor(2) } }) end) == false)
+      end
+   end,
+
+   testNestedListsAsTensors = function()
+      for _,protocol in ipairs({ "binary", "compact" }) do
+         local codec = thrift.codec({
+            ttype = 'struct',
+            protocol = protocol,
+            fields = {
+               [1] = { ttype = 'list', value = { ttype = 'list', value = 'double' }, shape = 'fixed', name = 'matrix' },
+               [2] = { ttype = 'list', value = { ttype = 'list', value = { ttype = 'list', value = 'i32' } }, shape = 'fixed', name = 'cube' },
+               [3] = { ttype = 'list', value = { ttype = 'set', value = 'i64' }, shape = 'ragged', name = 'rows' },
+            },
+         })
+         local matrix = torch.DoubleTensor({ { 1, 2, 3 }, { 4, 5, 6 } })
+         local cube = torch.IntTensor(2, 3, 4):random(-1000, 1000)
+         local rows = { values = torch.LongTensor({ 7, 8, 9 }), offsets = torch.LongTensor({ 0, 1, 1, 3 }) }
+         local x = codec:read(codec:write({ matrix = matrix, cube = cube, rows = rows }))
+         assert(torch.all(torch.eq(x.matrix, matrix)))
+         assert(torch.all(torch.eq(x.cube, cube)))
+         assert(torch.all(torch.eq(x.rows.values, rows.values)) and torch.all(torch.eq(x.rows.offsets, rows.offsets)))
+         -- non contiguous tensors and plain tables
+         x = codec:read(codec:write({ matrix = matrix:t(), rows = { { 1 }, { 2, 3 } } }))
+         assert(torch.all(torch.eq(x.matrix, matrix:t())))
+         assert(x.rows.values:size(1) == 3 and x.rows.offsets[3] == 3)
+         x = codec:read(codec:write({ matrix = { }, rows = { } }))
+         assert(x.matrix:nElement() == 0 and x.rows.values:nElement() == 0 and x.rows.offsets:size(1) == 1)
+         -- fixed shapes need inner lists of the same length
+         local bytes = codec:write({ matrix = { { 1, 2 }, { 3 } } })
+         assert(pcall(function() return codec:read(bytes) end) == false)
+         assert(pcall(function() return codec:write({ matrix = torch.DoubleTensor(4) }) end) == false)
+         assert(pcall(function() return codec:write({ rows = { values = torch.LongTensor(2), offsets = torch.LongTensor({ 0, 3 }) } }) end) == false)
+      end
+   end,
+
+   testListOfStructsAsColumns = function()
+      local item = {
+         ttype = 'struct',
+         fields = {
+            [1] = { ttype = 'i64', name = 'id' },
+            [2] = { ttype = 'double', name = 'score' },
+            [3] = { ttype = 'i32', name = 'pos' },
+            [4] = { ttype = 'bool', name = 'seen' },
+         },
+      }
+      for _,protocol in ipairs({ "binary", "compact" }) do
+         local rows = thrift.codec({ ttype = 'list', value = item, protocol = protocol })
+         local columns = thrift.codec({ ttype = 'list', value = item, shape = 'columns', protocol = protocol })
+         local items = {
+            { id = 10, score = 0.5, pos = 1, seen = true },
+            { id = 20, score = 1.5 },
+            { id = 30, score = 2.5, pos = 3, seen = false },
+         }
+         local x = columns:read(rows:write(items))
+         assert(torch.all(torch.eq(x.values.id, torch.LongTensor({ 10, 20, 30 }))))
+         assert(torch.all(torch.eq(x.values.score, torch.DoubleTensor({ 0.5, 1.5, 2.5 }))))
+         assert(torch.all(torch.eq(x.values.pos, torch.IntTensor({ 1, 0, 3 }))))
+         assert(torch.all(torch.eq(x.present.pos, torch.ByteTensor({ 1, 0, 1 }))))
+         assert(torch.all(torch.eq(x.values.seen, torch.ByteTensor({ 1, 0, 0 }))))
+         local y = rows:read(columns:write(x))
+         assert(#y == 3 and y[2].pos == nil and y[2].seen == nil and y[3].seen == false and y[1].id == 10 and y[3].score == 2.5)
+         -- any tensor type, fields without a tensor are left out
+         y = rows:read(columns:write({ values = { id = torch.FloatTensor({ 4, 5 }) } }))
+         assert(#y == 2 and y[2].id == 5 and y[2].score == nil)
+         x = columns:read(columns:write({ values = { } }))
+         assert(x.values.id:nElement() == 0)
+         -- plain tables are still written as lists
+         assert(columns:read(columns:write(items)).values.id[3] == 30)
+         assert(pcall(function() return columns:write({ values = { id = torch.LongTensor(2), score = torch.DoubleTensor(3) } }) end) == false)
+         assert(pcall(function() return columns:write({ values = { pos = torch.LongTensor({ 2^40 }) } }) end) == false)
+         assert(pcall(function() return columns:write({ values = { pos = torch.DoubleTensor({ 1.5 }) } }) end) == false)
+         assert(pcall(function() return columns:write({ values = { id = torch.DoubleTensor({ 0/0 }) } }) end) == false)
+      end
+      assert(pcall(function() return thrift.codec({ ttype = 'list', value = { ttype = 'struct', fields = { 'string' } }, shape = 'columns' }) end) == false)
+   end,
+
+   testSerializeCodec = function()
+      local desc = {
+         ttype = 'struct',
+         protocol = 'compact',
+         stats = true,
+         fields = {
+            [1] = { ttype = 'i32', name = 'id' },
+            [2] = { ttype = 'map', key = 'string', value = { ttype = 'list', value = 'double' }, name = 'scores' },
+            [5] = { ttype = 'struct', name = 'inner', fields = { [1] = 'string', [2] = { ttype = 'bool', name = 'flag' } } },
+         },
+      }
+      local codec = thrift.codec(desc)
+      local blob = codec:serialize()
+      assert(type(blob) == 'string')
+      local copy = thrift.codecFromBlob(blob)
+      local value = { id = 7, scores = { a = { 0.5, 1 } }, inner = { [1] = 'x', flag = true } }
+      local binary = codec:write(value)
+      assert(copy:write(value) == binary)
+      local x = copy:read(binary)
+      assert(x.id == 7 and x.scores.a[2] == 1 and x.inner[1] == 'x' and x.inner.flag == true)
+      assert(copy:stats().recordsRead == 1 and codec:stats().recordsRead == 0)
+      assert(thrift.codecFromBlob(copy:serialize()):read(binary).id == 7)
+      assert(pcall(function() return thrift.codecFromBlob(blob:sub(1, -2)) end) == false)
+      assert(pcall(function() return thrift.codecFromBlob('nonsense') end) == false)
+      -- fields 1 and 3 without names end the blob with their index [1, 0, 2]
+      local plain = thrift.codec({ ttype = 'struct', fields = { [1] = 'i32', [3] = 'i32' } })
+      local sparse = plain:serialize()
+      assert(thrift.codecFromBlob(sparse):read(plain:write({ [1] = 5, [3] = 6 }))[3] == 6)
+      local entries = { '\9\9' .. sparse:sub(-4), sparse:sub(-2) .. sparse:sub(-4, -3) .. sparse:sub(-6, -5) }
+      for _,tampered in ipairs(entries) do
+         assert(pcall(function() return thrift.codecFromBlob(sparse:sub(1, -7) .. tampered) end) == false)
+      end
+      -- a fixed and a ragged codec only differ in the shape byte, which is
+      -- followed by the number of nested levels
+      local nested = { ttype = 'list', value = { ttype = 'list', value = 'double' }, shape = 'fixed' }
+      local fixed = thrift.codec(nested):serialize()
+      nested.shape = 'ragged'
+      local ragged = thrift.codec(nested):serialize()
+      local at
+      for i = 1,#fixed do
+         if fixed:byte(i) == 1 and ragged:byte(i) == 2 then at = i break end
+      end
+      assert(thrift.codecFromBlob(fixed:sub(1, at - 1) .. '\2' .. fixed:sub(at + 1)) ~= nil)
+      for _,altered in ipairs({ '\9\2', '\1\255' }) do
+         local ok, err = pcall(function() return thrift.codecFromBlob(fixed:sub(1, at - 1) .. altered .. fixed:sub(at + 2)) end)
+         assert(ok == false and string.find(err, 'malformed codec blob'))
+      end
+   end,
+
+   testReadInto = function()
+      local codec = thrift.codec({
+         ttype = 'struct',
+         tensors = true,
+         stats = true,
+         fields = {
+            [1] = { ttype = 'i32', name = 'id' },
+            [2] = { ttype = 'list', value = 'double', name = 'values' },
+            [3] = { ttype = 'list', value = { ttype = 'struct', fields = { { ttype = 'string', name = 's' } } }, name = 'items' },
+            [4] = { ttype = 'map', key = 'string', value = 'i32', name = 'counts' },
+         },
+      })
+      local first = codec:write({ id = 1, values = torch.DoubleTensor({ 1, 2, 3 }), items = { { s = 'x' }, { s = 'y' } }, counts = { a = 1 } })
+      local second = codec:write({ values = torch.DoubleTensor({ 4, 5 }), items = { { s = 'z' } }, counts = { b = 2 } })
+      local target = codec:read(first)
+      local values, items, item = target.values, target.items, target.items[1]
+      assert(codec:readInto(second, target) == target)
+      assert(target.id == nil and target.values == values and target.items == items and items[1] == item)
+      assert(values:size(1) == 2 and values[1] == 4 and values[2] == 5)
+      assert(item.s == 'z' and items[2] == nil and target.counts.a == nil and target.counts.b == 2)
+      local bytes = codec:writeTensor({ values = torch.DoubleTensor({ 6, 7 }), items = { { s = 'z' } } })
+      local allocations = codec:stats().allocations
+      codec:readInto(bytes, target)
+      assert(target.values == values and values[2] == 7 and target.counts == nil)
+      assert(codec:stats().allocations == allocations, 'tables and tensors are reused')
+      local fresh = codec:readInto(first)
+      assert(fresh.id == 1 and fresh.values:size(1) == 3 and fresh.items[2].s == 'y')
+   end,
+
    testReadWriteTensors = function()
       local codec = thrift.codec({ ttype = 'struct', fields = { 'i32', 'string' } })
       local bytes = codec:writeTensor({ 13, 'hello' })
@@ -462,6 +726,591 @@ test {
       assert(result[2] == 'hello')
    end,
 
+   testWriteSizes = function()
+      local codec = thrift.codec({
+         ttype = "struct",
+         tensors = true,
+         fields = {
+            [1] = { ttype = "map", key = "i64", value = "double", name = "weights" },
+            [2] = { ttype = "list", value = "string", name = "tokens" },
+            [3] = { ttype = "list", value = "i32", name = "ids" },
+            [4] = { ttype = "set", value = { ttype = "struct", fields = { "bool", "i16" } }, name = "pairs" },
+            [6] = { ttype = "byte", name = "flag" },
+            [9] = "string",
+         },
+      })
+      local data = {
+         weights = { [3] = 0.5, [17] = -1.25 },
+         tokens = { "", "a", string.rep("x", 1000) },
+         ids = torch.IntTensor(77):random(0, 1000),
+         pairs = { { true, 7 }, { false, -7 } },
+         flag = 3,
+         [9] = string.rep("y", 70000),
+      }
+      local str = codec:write(data)
+      local bytes = codec:writeTensor(data)
+      assert(bytes:size(1) == string.len(str))
+      for i = 1,bytes:size(1),997 do
+         assert(bytes[i] == string.byte(str, i))
+      end
+      local result = codec:readTensor(bytes)
+      assert(result.weights[17] == -1.25)
+      assert(result.tokens[3] == data.tokens[3])
+      assert(torch.all(torch.eq(result.ids, data.ids)))
+      assert(result.pairs[2][2] == -7)
+      assert(result[9] == data[9])
+      -- values that fail to encode still raise after the buffer is sized
+      local small = thrift.codec({ ttype = "struct", fields = { "i32", "i16" } })
+      assert(pcall(function() return small:write({ 1, 40000 }) end) == false)
+      assert(pcall(function() return small:writeTensor({ 1, 40000 }) end) == false)
+   end,
+
+   testStringsAsTensors = function()
+      local codec = thrift.codec({
+         ttype = 'struct',
+         stringsAsTensors = true,
+         fields = {
+            [1] = { ttype = 'string', name = 'blob' },
+            [2] = { ttype = 'map', key = 'string', value = 'string', name = 'attrs' },
+            [3] = { ttype = 'list', value = 'string', name = 'parts' },
+         },
+      })
+      local value = { blob = 'abc', attrs = { k = 'v' }, parts = { 'x', '' } }
+      local bytes = codec:writeTensor(value)
+      local x = codec:readTensor(bytes)
+      assert(torch.isTensor(x.blob) and x.blob:size(1) == 3 and x.blob[2] == string.byte('b'))
+      assert(torch.isTensor(x.attrs.k) and x.attrs.k[1] == string.byte('v'))
+      assert(torch.isTensor(x.parts[1]) and x.parts[2]:nElement() == 0)
+      -- views share the input
+      assert(torch.pointer(x.blob:storage()) == torch.pointer(bytes:storage()))
+      x.blob[1] = string.byte('z')
+      assert(codec:read(codec:write(x)).blob == 'zbc')
+      bytes = nil
+      collectgarbage()
+      assert(x.blob[3] == string.byte('c'))
+      -- strings are still strings when reading strings
+      assert(codec:read(codec:write(value)).blob == 'abc')
+   end,
+
+   testReadBatch = function()
+      local codec = thrift.codec({ ttype = 'struct', fields = { 'i32', 'string' } })
+      local records = { { 1, 'a' }, { 2, 'bb' }, { 3, '' }, { 4, 'dddd' } }
+      local plain, framed = { }, { }
+      for _,r in ipairs(records) do
+         local bytes = codec:write(r)
+         local len = string.len(bytes)
+         table.insert(plain, bytes)
+         table.insert(framed, string.char(0, 0, math.floor(len / 256), len % 256) .. bytes)
+      end
+      local function tensor(str)
+         local t = torch.ByteTensor(string.len(str))
+         for i = 1,string.len(str) do t[i] = string.byte(str, i) end
+         return t
+      end
+      local all = tensor(table.concat(plain))
+      local result, offset = codec:readBatch(all)
+      assert(#result == 4 and offset == all:size(1))
+      for i,r in ipairs(records) do
+         assert(result[i][1] == r[1] and result[i][2] == r[2])
+      end
+      result, offset = codec:readBatch(all, 2)
+      assert(#result == 2 and offset == string.len(plain[1]) + string.len(plain[2]))
+      local frames = tensor(table.concat(framed))
+      result, offset = codec:readBatch(frames, nil, true)
+      assert(#result == 4 and offset == frames:size(1))
+      assert(result[4][2] == 'dddd')
+      -- a frame that claims more bytes than are left
+      local bad = tensor(string.char(0, 0, 1, 0) .. plain[1])
+      assert(pcall(function() return codec:readBatch(bad, nil, true) end) == false)
+   end,
+
+   testWriteInto = function()
+      local codec = thrift.codec({ ttype = 'struct', fields = { 'i32', 'string' } })
+      local records = { { 1, 'a' }, { 2, 'bb' }, { 3, '' }, { 4, 'dddd' } }
+      local bytes, offset = torch.ByteTensor(), 0
+      for _,r in ipairs(records) do
+         offset = codec:writeInto(bytes, offset, r, true)
+      end
+      assert(bytes:size(1) >= offset)
+      local result, last = codec:readBatch(bytes:narrow(1, 1, offset), nil, true)
+      assert(#result == 4 and last == offset and result[2][2] == 'bb')
+      -- appending without frames matches write
+      local plain = codec:writeInto(bytes, 0, records[4])
+      assert(plain == string.len(codec:write(records[4])))
+      assert(codec:readTensor(bytes:narrow(1, 1, plain))[2] == 'dddd')
+      assert(pcall(function() return codec:writeInto(bytes, bytes:size(1) + 1, records[1]) end) == false)
+   end,
+
+   testIndexAndValidate = function()
+      local codec = thrift.codec({ ttype = 'struct', fields = { 'i32', 'string', { ttype = 'list', value = 'double' } } })
+      local records = { { 1, 'a', { 1 } }, { 2 }, { 3, 'ccc', { } } }
+      for _,framed in ipairs({ false, true }) do
+         local bytes, offset = torch.ByteTensor(), 0
+         local starts = { }
+         for i,r in ipairs(records) do
+            starts[i] = offset
+            offset = codec:writeInto(bytes, offset, r, framed)
+         end
+         bytes = bytes:narrow(1, 1, offset)
+         local offsets, last = codec:index(bytes, nil, framed)
+         assert(offsets:size(1) == 3 and last == offset)
+         for i = 1,3 do
+            assert(offsets[i] == starts[i])
+         end
+         offsets, last = codec:index(bytes, 2, framed)
+         assert(offsets:size(1) == 2 and last == starts[3])
+      end
+      local binary = codec:write(records[1])
+      assert(codec:validate(binary) == #binary)
+      assert(codec:validate(binary .. 'trailing') == #binary)
+      local size, err = codec:validate(binary:sub(1, -2))
+      assert(size == nil and type(err) == 'string')
+      -- a string claiming more bytes than there are
+      assert(codec:validate(fromBytes({ 11, 0, 2, 0, 0, 1, 0, 97, 0 })) == nil)
+      assert(pcall(function() return codec:index(torch.ByteTensor({ 8, 0, 1, 0 })) end) == false)
+   end,
+
+   testOpenFile = function()
+      local codec = thrift.codec({ ttype = 'struct', fields = { 'i32', 'string' } })
+      local plain, framed = { }, { }
+      for i = 1,100 do
+         local bytes = codec:write({ i, string.rep('x', i % 7) })
+         local len = string.len(bytes)
+         table.insert(plain, bytes)
+         table.insert(framed, string.char(0, 0, math.floor(len / 256), len % 256) .. bytes)
+      end
+      local function save(parts)
+         local path = os.tmpname()
+         local f = io.open(path, 'wb')
+         f:write(table.concat(parts))
+         f:close()
+         return path
+      end
+      for _,isFramed in ipairs({ false, true }) do
+         local path = save(isFramed and framed or plain)
+         local file = codec:openFile(path, isFramed)
+         local n = 0
+         for record in file do
+            n = n + 1
+            assert(record[1] == n and record[2] == string.rep('x', n % 7))
+         end
+         assert(n == 100 and file:count() == 100 and #file == 100)
+         assert(file:read(42)[1] == 42 and file:read(1)[1] == 1 and file:read(101) == nil)
+         file:rewind()
+         assert(file()[1] == 1)
+         file:close()
+         assert(pcall(function() return file() end) == false)
+         os.remove(path)
+      end
+      local path = save({ })
+      local n = 0
+      for _ in codec:openFile(path) do n = n + 1 end
+      assert(n == 0 and codec:openFile(path):count() == 0)
+      os.remove(path)
+      assert(pcall(function() return codec:openFile(path) end) == false)
+   end,
+
+   testBlockFiles = function()
+      local codec = thrift.codec({ ttype = 'struct', fields = { 'i32', 'string' } })
+      for _,compression in ipairs({ 'zlib', 'none' }) do
+         local path = os.tmpname()
+         local writer = codec:openBlockWriter(path, { compression = compression, blockSize = 512 })
+         for i = 1,1000 do
+            writer:write({ i, string.rep('x', i % 7) })
+         end
+         assert(pcall(function() return writer:write({ 2^40, 'x' }) end) == false)
+         writer:close()
+         assert(pcall(function() return writer:write({ 1, 'x' }) end) == false)
+         -- raw block sizes past the limit or past what the compressed bytes
+         -- can hold are rejected before anything is allocated for them
+         assert(pcall(function() return codec:openBlockFile(path, 2, 16) end) == false)
+         local good = io.open(path, 'rb'):read('*all')
+         local f = io.open(path, 'wb')
+         f:write(good:sub(1, 12) .. '\255\255\255\240' .. good:sub(17))
+         f:close()
+         assert(pcall(function() return codec:openBlockFile(path) end) == false)
+         f = io.open(path, 'wb')
+         f:write(good)
+         f:close()
+         for _,prefetch in ipairs({ 1, 4 }) do
+            local file = codec:openBlockFile(path, prefetch)
+            assert(file:count() == 1000 and #file == 1000)
+            local n = 0
+            for record in file do
+               n = n + 1
+               assert(record[1] == n and record[2] == string.rep('x', n % 7))
+               if n == 700 then break end
+            end
+            file:rewind()
+            assert(file()[1] == 1 and file()[1] == 2)
+            file:close()
+            assert(pcall(function() return file() end) == false)
+         end
+         os.remove(path)
+      end
+      local path = os.tmpname()
+      codec:openBlockWriter(path):close()
+      local n = 0
+      for _ in codec:openBlockFile(path) do n = n + 1 end
+      assert(n == 0)
+      -- footers whose index offset or block count point past the file,
+      -- the first one wraps around to look consistent
+      local empty = io.open(path, 'rb'):read('*all')
+      local f
+      for _,footer in ipairs({ string.rep('\255', 7) .. '\252\0\0\0\1', '\0\0\0\0\0\0\0\8\0\0\0\1' }) do
+         f = io.open(path, 'wb')
+         f:write(empty:sub(1, 8) .. footer .. empty:sub(-4))
+         f:close()
+         assert(pcall(function() return codec:openBlockFile(path) end) == false)
+      end
+      f = io.open(path, 'wb')
+      f:write(codec:write({ 1, 'plain records' }))
+      f:close()
+      assert(pcall(function() return codec:openBlockFile(path) end) == false)
+      os.remove(path)
+      assert(pcall(function() return codec:openBlockWriter(path, { compression = 'rar' }) end) == false)
+   end,
+
+   testReadColumns = function()
+      local codec = thrift.codec({
+         ttype = "struct",
+         fields = {
+            [1] = { ttype = "i64", name = "id" },
+            [2] = { ttype = "list", value = "string", name = "tags" },
+            [3] = { ttype = "struct", name = "user", fields = {
+               [1] = { ttype = "i32", name = "age" },
+               [2] = { ttype = "map", key = "string", value = "double", name = "scores" },
+               [4] = { ttype = "double", name = "weight" },
+            } },
+            [5] = "bool",
+         },
+      })
+      local records = {
+         { id = 7, tags = { "a", "b" }, user = { age = 31, scores = { x = 1 }, weight = 1.5 }, [5] = true },
+         { id = 8, user = { scores = { }, weight = -2 } },
+         { id = 9, tags = { }, [5] = false },
+      }
+      local str = ""
+      for _,r in ipairs(records) do str = str .. codec:write(r) end
+      local bytes = torch.ByteTensor(string.len(str))
+      for i = 1,string.len(str) do bytes[i] = string.byte(str, i) end
+      local ids, ages, weights, flags = torch.LongTensor(5):fill(-1), torch.IntTensor(5), torch.FloatTensor(5), torch.ByteTensor(5)
+      local hasAge, hasFlag = torch.ByteTensor(5), torch.ByteTensor(5)
+      local rows, offset = codec:readColumns(bytes, {
+         { path = "id", tensor = ids },
+         { path = "user.age", tensor = ages, mask = hasAge },
+         { path = "user.4", tensor = weights },
+         { path = "5", tensor = flags, mask = hasFlag },
+      })
+      assert(rows == 3 and offset == bytes:size(1))
+      assert(ids[1] == 7 and ids[2] == 8 and ids[3] == 9 and ids[4] == -1)
+      assert(ages[1] == 31 and ages[2] == 0 and ages[3] == 0)
+      assert(hasAge[1] == 1 and hasAge[2] == 0 and hasAge[3] == 0)
+      assert(weights[1] == 1.5 and weights[2] == -2 and weights[3] == 0)
+      assert(flags[1] == 1 and flags[3] == 0)
+      assert(hasFlag[1] == 1 and hasFlag[2] == 0 and hasFlag[3] == 1)
+      rows, offset = codec:readColumns(bytes, { { path = "id", tensor = ids } }, 1)
+      assert(rows == 1 and offset == string.len(codec:write(records[1])))
+      assert(pcall(function() codec:readColumns(bytes, { { path = "tags", tensor = ids } }) end) == false)
+      assert(pcall(function() codec:readColumns(bytes, { { path = "user.nope", tensor = ids } }) end) == false)
+   end,
+
+   testReadSparse = function()
+      local codec = thrift.codec({
+         ttype = 'struct',
+         fields = {
+            [1] = { ttype = 'i32', name = 'id' },
+            [2] = { ttype = 'struct', name = 'user', fields = {
+               [1] = { ttype = 'map', key = 'i64', value = 'double', name = 'features' },
+               [2] = { ttype = 'map', key = 'i32', value = 'i16', name = 'counts' },
+            } },
+         },
+      })
+      local records = {
+         { id = 1, user = { features = { [10] = 0.5 }, counts = { [3] = 4 } } },
+         { id = 2 },
+         { id = 3, user = { features = { [7] = 1.5, [8] = 2.5 } } },
+      }
+      local bytes, offset = torch.ByteTensor(), 0
+      for _,r in ipairs(records) do
+         offset = codec:writeInto(bytes, offset, r, true)
+      end
+      bytes = bytes:narrow(1, 1, offset)
+      local offsets, indices, values, last = codec:readSparse(bytes, 'user.features', nil, true)
+      assert(last == offset)
+      assert(offsets:size(1) == 4 and offsets[1] == 0 and offsets[2] == 1 and offsets[3] == 1 and offsets[4] == 3)
+      assert(indices[1] == 10 and values[1] == 0.5 and indices:size(1) == 3)
+      assert(values[2] + values[3] == 4)
+      offsets, indices, values = codec:readSparse(bytes, '2.2', 2, true, 'float')
+      assert(offsets:size(1) == 3 and indices[1] == 3 and values[1] == 4 and torch.type(values) == 'torch.FloatTensor')
+      assert(pcall(function() return codec:readSparse(bytes, 'id', nil, true) end) == false)
+      assert(pcall(function() return codec:readSparse(bytes, 'user.missing', nil, true) end) == false)
+   end,
+
+   testReadColumnsThreads = function()
+      local desc = {
+         ttype = "struct",
+         fields = {
+            [1] = { ttype = "i32", name = "id" },
+            [2] = { ttype = "string", name = "text" },
+            [3] = { ttype = "double", name = "score" },
+         },
+      }
+      local parts, framed = { }, { }
+      local n = 3000
+      local single = thrift.codec(desc)
+      for i = 1,n do
+         local bytes = single:write({ id = i, text = string.rep("t", i % 5), score = (i % 2 == 0) and i / 2 or nil })
+         local len = string.len(bytes)
+         table.insert(parts, bytes)
+         table.insert(framed, string.char(0, 0, math.floor(len / 256), len % 256) .. bytes)
+      end
+      local function tensor(str)
+         local t = torch.ByteTensor(string.len(str))
+         for i = 1,string.len(str) do t[i] = string.byte(str, i) end
+         return t
+      end
+      desc.threads = 4
+      local threaded = thrift.codec(desc)
+      for _,isFramed in ipairs({ false, true }) do
+         local bytes = tensor(table.concat(isFramed and framed or parts))
+         local ids, scores, hasScore = torch.IntTensor(n + 1):fill(-1), torch.DoubleTensor(n), torch.ByteTensor(n)
+         local rows, offset = threaded:readColumns(bytes, {
+            { path = "id", tensor = ids },
+            { path = "score", tensor = scores, mask = hasScore },
+         }, nil, isFramed)
+         assert(rows == n and offset == bytes:size(1) and ids[n + 1] == -1)
+         for i = 1,n do
+            assert(ids[i] == i and hasScore[i] == (i % 2 == 0 and 1 or 0))
+            assert(scores[i] == ((i % 2 == 0) and i / 2 or 0))
+         end
+         rows, offset = threaded:readColumns(bytes, { { path = "id", tensor = ids } }, 1000, isFramed)
+         local _, expected = single:readColumns(bytes, { { path = "id", tensor = ids } }, 1000, isFramed)
+         assert(rows == 1000 and offset == expected)
+      end
+      assert(pcall(function() return thrift.codec({ ttype = "i32", threads = 0 }) end) == false)
+   end,
+
+   testProjection = function()
+      local full = thrift.codec({
+         ttype = "struct",
+         fields = {
+            [1] = "i32",
+            [2] = { ttype = "map", key = "i64", value = { ttype = "set", value = "string" } },
+            [3] = { ttype = "string", name = "text" },
+            [4] = { ttype = "list", value = { ttype = "struct", fields = { "double", { ttype = "list", value = "i16" } } } },
+            [5] = { ttype = "struct", name = "inner", fields = { "bool", "string", "i64" } },
+         },
+      })
+      local bytes = full:write({
+         [1] = 5,
+         [2] = { [1] = { "x", "y" }, [2] = { } },
+         text = "kept",
+         [4] = { { 1.5, { 1, 2, 3 } }, { 2.5, { } } },
+         inner = { true, "skipped", 42 },
+      })
+      local narrow = {
+         ttype = "struct",
+         fields = {
+            [3] = { ttype = "string", name = "text" },
+            [5] = { ttype = "struct", name = "inner", fields = { [3] = "i64" } },
+         },
+      }
+      assert(pcall(function() return thrift.codec(narrow):read(bytes) end) == false)
+      narrow.projection = true
+      local result = thrift.codec(narrow):read(bytes)
+      assert(result.text == "kept")
+      assert(result.inner[3] == 42 and result.inner[1] == nil and result.inner[2] == nil)
+      assert(result[1] == nil and result[2] == nil and result[4] == nil)
+      -- a listed field whose type changed is skipped too
+      local changed = thrift.codec({ ttype = "struct", projection = true, fields = { [1] = "string", [3] = "string" } })
+      result = changed:read(bytes)
+      assert(result[1] == nil and result[3] == "kept")
+      -- skipping still checks bounds
+      assert(pcall(function() return thrift.codec(narrow):read(string.sub(bytes, 1, 30)) end) == false)
+   end,
+
+   testCompact = function()
+      local desc = {
+         ttype = "struct",
+         fields = {
+            [1] = "i32",
+            [2] = { ttype = "bool", name = "yes" },
+            [3] = { ttype = "bool", name = "no" },
+            [4] = { ttype = "map", key = "i64", value = { ttype = "set", value = "string" } },
+            [40] = { ttype = "double", name = "far" },
+            [41] = { ttype = "list", value = "i16" },
+            [42] = { ttype = "struct", fields = { "byte", "string", "i64" } },
+         },
+      }
+      local value = {
+         [1] = -123456,
+         yes = true,
+         no = false,
+         [4] = { [-1] = { "x" }, [1099511627776] = { "y", "z" } },
+         far = -2.5,
+         [41] = { -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 32767 },
+         [42] = { 255, "deep", -9007199254740992 },
+      }
+      local function same(a, b)
+         if type(a) ~= "table" then return a == b end
+         for k,v in pairs(a) do if not same(v, b[k]) then return false end end
+         for k in pairs(b) do if a[k] == nil then return false end end
+         return true
+      end
+      local binary = thrift.codec(desc)
+      desc.protocol = "compact"
+      local compact = thrift.codec(desc)
+      local bytes = compact:write(value)
+      assert(#bytes < #binary:write(value))
+      assert(same(compact:read(bytes), value))
+      assert(same(compact:read(compact:writeTensor(value)), value))
+      -- field 1 = 1 is a delta header, a zigzag varint and a stop
+      local small = thrift.codec({ ttype = "struct", protocol = "compact", fields = { "i32" } })
+      assert(small:write({ 1 }) == fromBytes({ 0x15, 0x02, 0x00 }))
+      -- transcode goes both ways and preserves the type of its input
+      assert(binary:transcode(binary:write(value)) == bytes)
+      assert(compact:transcode(bytes) == binary:write(value))
+      local tensor = compact:transcode(binary:writeTensor(value))
+      assert(torch.typename(tensor) == "torch.ByteTensor")
+      assert(same(compact:read(tensor), value))
+      -- numeric lists as tensors use zigzag varints
+      local tensors = thrift.codec({ ttype = "list", value = "i64", tensors = true, protocol = "compact" })
+      local values = torch.LongTensor({ -1, 0, 1, 1099511627776, -1099511627776 })
+      local result = tensors:read(tensors:write(values))
+      assert(torch.typename(result) == "torch.LongTensor" and result:equal(values))
+      assert(pcall(function() return thrift.codec({ ttype = "i32", protocol = "json" }) end) == false)
+   end,
+
+   testLazy = function()
+      local desc = {
+         ttype = "struct",
+         fields = {
+            [1] = "i32",
+            [2] = { ttype = "string", name = "text" },
+            [3] = { ttype = "map", key = "string", value = { ttype = "list", value = "double" } },
+            [4] = { ttype = "list", value = { ttype = "struct", fields = { { ttype = "bool", name = "flag" }, "string" } } },
+            [5] = { ttype = "struct", name = "user", fields = { { ttype = "i64", name = "id" }, { ttype = "string", name = "name" } } },
+            [6] = { ttype = "list", value = "i16", name = "small" },
+         },
+      }
+      local value = {
+         [1] = 7,
+         text = "hello",
+         [3] = { a = { 1.5, 2.5 }, b = { } },
+         [4] = { { flag = true, [2] = "x" }, { flag = false, [2] = "y" } },
+         user = { id = 42, name = "ann" },
+         small = { 3, 2, 1 },
+      }
+      for _,protocol in ipairs({ "binary", "compact" }) do
+         desc.protocol = protocol
+         local codec = thrift.codec(desc)
+         local bytes = codec:write(value)
+         local lazy = codec:readLazy(bytes)
+         assert(lazy[1] == 7 and lazy.text == "hello" and lazy[2] == nil and #lazy == 6)
+         assert(lazy[3].a[2] == 2.5 and #lazy[3].b == 0 and lazy[3].c == nil)
+         assert(#lazy[4] == 2 and lazy[4][1].flag == true and lazy[4][2].flag == false and lazy[4][2][2] == "y")
+         assert(lazy[4][3] == nil)
+         assert(lazy.user.id == 42 and lazy.user.name == "ann")
+         assert(#lazy.small == 3 and lazy.small[3] == 1 and lazy.small[0] == nil)
+         local user = lazy.user
+         local all = user()
+         assert(all.id == 42 and all.name == "ann")
+         -- proxies hold on to their input
+         lazy = codec:readLazy(codec:writeTensor(value))
+         collectgarbage()
+         assert(lazy[4][1][2] == "x")
+         -- calling a proxy decodes strings the same way field access does
+         desc.stringsAsTensors = true
+         lazy = thrift.codec(desc):readLazy(codec:writeTensor(value))
+         desc.stringsAsTensors = nil
+         assert(torch.isTensor(lazy.user.name) and torch.isTensor(lazy.user().name))
+         assert(torch.pointer(lazy.user().name:storage()) == torch.pointer(lazy.user.name:storage()))
+         -- map keys stay strings, so they can still be looked up
+         assert(lazy[3].a[2] == 2.5 and lazy[3].c == nil)
+         -- get decodes one field, by name or by id
+         assert(codec:get(bytes, "user.name") == "ann")
+         assert(codec:get(bytes, "5.1") == 42)
+         assert(codec:get(bytes, "text") == "hello")
+         assert(codec:get(codec:write({ [1] = 1 }), "user.id") == nil)
+         assert(pcall(function() return codec:get(bytes, "user.age") end) == false)
+         assert(pcall(function() return codec:get(bytes, "text.id") end) == false)
+      end
+   end,
+
+   testDeepNesting = function()
+      local function nested(depth)
+         local data = { }
+         for i = 1, depth do
+            data[#data + 1] = 0x0C
+            data[#data + 1] = 0x00
+            data[#data + 1] = 0x01
+         end
+         for i = 0, depth do
+            data[#data + 1] = 0x00
+         end
+         return fromBytes(data)
+      end
+      local codec = thrift.codec()
+      local value = codec:read(nested(32))
+      for i = 1, 32 do
+         value = value[1]
+      end
+      assert(next(value) == nil)
+      assert(pcall(function() return codec:read(nested(1000)) end) == false)
+      -- schemas nested the same way still round trip
+      local desc = { ttype = "struct", fields = { "i32" } }
+      for i = 1, 16 do
+         desc = { ttype = "struct", fields = { desc, { ttype = "list", value = "i16" } } }
+      end
+      local typed = thrift.codec(desc)
+      local x = { { { { { }, { 1, 2 } } } }, { 3 } }
+      local y = typed:read(typed:write(x))
+      assert(y[1][1][1][2][2] == 2 and y[2][1] == 3)
+   end,
+
+   testArrayFields = function()
+      local desc = {
+         ttype = "struct",
+         arrayFields = true,
+         fields = {
+            [1] = "i32",
+            [2] = "string",
+            [3] = { ttype = "list", value = "i16" },
+            [4] = { ttype = "double", name = "weight" },
+         },
+      }
+      local codec = thrift.codec(desc)
+      local x = codec:read(codec:write({ 1, "two", { 3 }, weight = 0.5 }))
+      assert(#x == 3 and x[1] == 1 and x[2] == "two" and x[3][1] == 3 and x.weight == 0.5)
+      x = codec:read(codec:write({ [2] = "two" }))
+      assert(x[1] == nil and x[2] == "two" and x.weight == nil)
+      desc.arrayFields = nil
+      assert(thrift.codec(desc):read(codec:write({ 1, "two" }))[2] == "two")
+   end,
+
+   testStats = function()
+      local codec = thrift.codec({
+         ttype = "struct",
+         stats = true,
+         fields = {
+            [1] = { ttype = "i32", name = "a" },
+            [2] = { ttype = "list", name = "items", value = { ttype = "struct", fields = { { ttype = "string", name = "s" } } } },
+         },
+      })
+      local binary = codec:write({ a = 5, items = { { s = "xy" }, { s = "z" } } })
+      codec:read(binary)
+      local stats = codec:stats()
+      assert(stats.recordsRead == 1 and stats.recordsWritten == 1)
+      assert(stats.bytesRead == #binary and stats.bytesWritten == #binary)
+      assert(stats.ttypes.i32.count == 2 and stats.ttypes.i32.bytes == 8)
+      assert(stats.fields.a.count == 2 and stats.fields.items.count == 2)
+      assert(stats.fields["items.s"].count == 4 and stats.fields["items.s"].bytes == 2 * (4 + 2 + 4 + 1))
+      codec:resetStats()
+      assert(codec:stats().recordsRead == 0 and next(codec:stats().fields) == nil)
+      assert(pcall(function() return thrift.codec():stats() end) == false)
+   end,
+
    testUnions = function()
       local Tweet = {
          name = "tweet",